@@ -0,0 +1,116 @@
+#!/bin/bash
+# Runs l2h over a grid of file counts, file sizes and thread counts on
+# corpora made by gen-corpus.sh, checking every output against the hashes
+# of the output of a separate reference binary, and writes the timings
+# as CSV.
+#
+# Files are converted one after another; threads (-j) only help with
+# files of 2MB or more, which are split between their top-level forms.
+# Rows for smaller files show what the threads cost, not what they gain.
+
+die() {
+   echo $@
+   exit 127
+}
+
+usage() {
+   echo "Usage: $0 [options] [-- gen-corpus.sh options]"
+   echo "  -b L2H       The l2h binary to benchmark (default ./l2h)"
+   echo "  -R L2H       The l2h binary that produces the reference hashes, such"
+   echo "               as a release build; it must not be the benchmarked binary"
+   echo "               (required)"
+   echo "  -F COUNTS    File counts to try (default \"10 100\")"
+   echo "  -Z SIZES     Mean file sizes in KB to try (default \"64 4096\")"
+   echo "  -J JOBS      Thread counts to try (default \"1 2 4\")"
+   echo "  -n REPS      Runs of each combination, the fastest is kept (default 3)"
+   echo "  -o FILE      Write the CSV to FILE instead of stdout"
+   echo "  -P           Run the benchmarked binary with --pipeline"
+   echo "  -U           Generate pages of one (html ...) form, which are never"
+   echo "               split (default: pages of many top-level forms)"
+   echo "  -k           Keep the corpora (in \$TMPDIR) instead of removing them"
+   exit 127
+}
+
+L2H=./l2h
+REF=
+COUNTS="10 100"
+SIZES="64 4096"
+JOBS="1 2 4"
+REPS=3
+OUT=
+KEEP=
+GENOPTS=-t
+PIPELINE=
+
+while getopts "b:R:F:Z:J:n:o:PUkh" opt; do
+   case $opt in
+      b) L2H=$OPTARG ;;
+      R) REF=$OPTARG ;;
+      F) COUNTS=$OPTARG ;;
+      Z) SIZES=$OPTARG ;;
+      J) JOBS=$OPTARG ;;
+      n) REPS=$OPTARG ;;
+      o) OUT=$OPTARG ;;
+      P) PIPELINE=--pipeline ;;
+      U) GENOPTS= ;;
+      k) KEEP=1 ;;
+      *) usage ;;
+   esac
+done
+shift $((OPTIND - 1))
+
+GEN="$(dirname "$0")/gen-corpus.sh"
+[ -x "$L2H" ] || die "Cannot execute $L2H."
+[ -z "$REF" ] && die "Need a reference binary (-R)."
+[ -x "$REF" ] || die "Cannot execute $REF."
+[ "`realpath "$REF"`" = "`realpath "$L2H"`" ] && die "The reference must be a different binary."
+[ -x "$GEN" ] || die "Cannot execute $GEN."
+
+WORKDIR=`mktemp -d "${TMPDIR:-/tmp}/l2h-bench.XXXXXX"` || die "Cannot create work directory."
+[ -z "$KEEP" ] && trap 'rm -rf "$WORKDIR"' EXIT
+
+now() {
+   date +%s.%N
+}
+
+hashes() {
+   (cd "$1" && find . -name '*.html' -type f | sort | xargs md5sum)
+}
+
+if [ ! -z "$OUT" ]; then
+   exec > "$OUT" || die "Cannot write to $OUT."
+fi
+
+echo "files,mean_kb,bytes,jobs,secs,mb_per_sec,speedup,verified"
+
+for NFILES in $COUNTS; do
+   for KB in $SIZES; do
+      CORPUS="$WORKDIR/corpus-$NFILES-$KB"
+      "$GEN" -n $NFILES -s $KB $GENOPTS "$@" "$CORPUS" > /dev/null || die "Failed to generate $CORPUS."
+      BYTES=`find "$CORPUS" -name '*.html.lisp' -type f -printf '%s\n' | awk '{ t += $1 } END { print t }'`
+
+      "$REF" -r "$CORPUS" || die "Reference conversion of $CORPUS failed."
+      hashes "$CORPUS" > "$WORKDIR/reference.md5"
+
+      BASE=
+      for J in $JOBS; do
+         BEST=
+         VERIFIED=ok
+         for ((R=0;R<$REPS;R++)); do
+            find "$CORPUS" -name '*.html' -type f -delete
+            START=`now`
+            "$L2H" -j $J $PIPELINE -r "$CORPUS" || VERIFIED=FAIL
+            END=`now`
+            hashes "$CORPUS" | cmp -s - "$WORKDIR/reference.md5" || VERIFIED=FAIL
+            BEST=`echo $START $END $BEST | awk '{ t = $2 - $1; print ($3 == "" || t < $3) ? t : $3 }'`
+         done
+         [ -z "$BASE" ] && BASE=$BEST
+         echo $NFILES $KB $BYTES $J $BEST $BASE $VERIFIED | awk '{
+            printf "%s,%s,%s,%s,%.3f,%.2f,%.2f,%s\n",
+                   $1, $2, $3, $4, $5, $3 / 1048576 / $5, $6 / $5, $7
+         }'
+      done
+
+      [ -z "$KEEP" ] && rm -rf "$CORPUS"
+   done
+done
@@ -0,0 +1,161 @@
+#!/bin/bash
+# Generates a synthetic corpus of '*.html.lisp' files for benchmarking.
+# The same options and seed always produce the same corpus (with the
+# same awk).
+
+die() {
+   echo $@
+   exit 127
+}
+
+usage() {
+   echo "Usage: $0 [options] DIR"
+   echo "  -n FILES     Number of files (default 100)"
+   echo "  -s KB        Mean file size in KB (default 64)"
+   echo "  -k SKEW      File size skew; 0 makes every file the mean size, larger"
+   echo "               values give a longer tail of big files (default 0)"
+   echo "  -d DEPTH     Maximum element nesting depth (default 8)"
+   echo "  -f FANOUT    Maximum children per element (default 6)"
+   echo "  -e PERCENT   Percentage of words that need HTML escaping (default 1)"
+   echo "  -l WORDS     Words per line of content (default 12)"
+   echo "  -w WIDTH     Files per directory, and directories per level (default 10)"
+   echo "  -t           Write each page as a sequence of top-level forms, which l2h"
+   echo "               splits between threads when the page is large enough"
+   echo "               (default: one (html ...) form, which is never split)"
+   echo "  -S SEED      Random seed (default 1)"
+   exit 127
+}
+
+FILES=100
+SIZE=64
+SKEW=0
+DEPTH=8
+FANOUT=6
+ESCAPE=1
+LINEWORDS=12
+WIDTH=10
+SEED=1
+TOPLEVEL=0
+
+while getopts "n:s:k:d:f:e:l:w:S:th" opt; do
+   case $opt in
+      n) FILES=$OPTARG ;;
+      s) SIZE=$OPTARG ;;
+      k) SKEW=$OPTARG ;;
+      d) DEPTH=$OPTARG ;;
+      f) FANOUT=$OPTARG ;;
+      e) ESCAPE=$OPTARG ;;
+      l) LINEWORDS=$OPTARG ;;
+      w) WIDTH=$OPTARG ;;
+      S) SEED=$OPTARG ;;
+      t) TOPLEVEL=1 ;;
+      *) usage ;;
+   esac
+done
+shift $((OPTIND - 1))
+
+[ -z "$1" ] && usage
+[ "$WIDTH" -lt 1 ] && die "Width must be at least 1."
+mkdir -p "$1" || die "Cannot create directory $1."
+
+awk -v out="$1" -v files=$FILES -v size=$SIZE -v skew=$SKEW -v maxdepth=$DEPTH \
+    -v fanout=$FANOUT -v escape=$ESCAPE -v linewords=$LINEWORDS -v width=$WIDTH \
+    -v seed=$SEED -v toplevel=$TOPLEVEL '
+
+function emit(s) {
+   printf "%s", s > fname
+   nbytes += length (s)
+}
+
+function word() {
+   if (rand () * 100 < escape)
+      return esc[int (rand () * nesc)]
+   return dict[int (rand () * ndict)]
+}
+
+function words(n,    i) {
+   for (i=0; i<n; i++)
+      emit((i ? " " : "") word())
+}
+
+function text(indent,    i, n) {
+   n = 1 + int (rand () * 3)
+   for (i=0; i<n; i++) {
+      emit("\n" indent)
+      words(linewords)
+   }
+}
+
+function element(depth, indent,    i, n) {
+   emit("\n" indent "(" tags[int (rand () * ntags)])
+   if (rand () < 0.3)
+      emit(" :class=\"c" int (rand () * 10) "\"")
+
+   if (depth >= maxdepth || nbytes >= target) {
+      emit(" ")
+      words(1 + int (rand () * linewords))
+      emit(")")
+      return
+   }
+
+   n = 1 + int (rand () * fanout)
+   for (i=0; i<n && nbytes < target; i++) {
+      if (rand () < 0.5) {
+         text(indent "   ")
+      } else {
+         element(depth + 1, indent "   ")
+      }
+   }
+   emit(")")
+}
+
+# Pareto distributed, with the given mean, capped at 100 times the mean.
+function file_size(    alpha, xm, ret) {
+   if (skew <= 0)
+      return size * 1024
+   alpha = 1 + 1 / skew
+   xm = size * 1024 * (alpha - 1) / alpha
+   ret = xm / ((1 - rand ()) ^ (1 / alpha))
+   return ret > size * 1024 * 100 ? size * 1024 * 100 : ret
+}
+
+BEGIN {
+   srand (seed)
+   ndict = split ("lorem ipsum dolor sit amet consectetur adipiscing elit sed do " \
+                  "eiusmod tempor incididunt ut labore et dolore magna aliqua enim ad " \
+                  "minim veniam quis nostrud exercitation ullamco laboris nisi aliquip " \
+                  "ex ea commodo consequat duis aute irure in reprehenderit voluptate " \
+                  "velit esse cillum fugiat nulla pariatur excepteur sint occaecat", d, " ")
+   for (i=1; i<=ndict; i++)
+      dict[i - 1] = d[i]
+   nesc = split ("Q&A a<b b>a & x&&y <tag> \"quoted\" it'\''s", d, " ")
+   for (i=1; i<=nesc; i++)
+      esc[i - 1] = d[i]
+   ntags = split ("div p span section article em strong li ul blockquote", d, " ")
+   for (i=1; i<=ntags; i++)
+      tags[i - 1] = d[i]
+
+   for (f=0; f<files; f++) {
+      dir = out "/" int (f / width / width) "/" int (f / width) % width
+      if (!(dir in made)) {
+         system ("mkdir -p \"" dir "\"")
+         made[dir] = 1
+      }
+      fname = dir "/page-" f ".html.lisp"
+      nbytes = 0
+      target = file_size()
+
+      if (toplevel) {
+         emit("(!DOCTYPE :html)\n(head (title Synthetic page-" f "))")
+         while (nbytes < target)
+            element(1, "")
+         emit("\n")
+      } else {
+         emit("(html\n   (head (title Synthetic page-" f "))\n   (body")
+         while (nbytes < target)
+            element(2, "      ")
+         emit("))\n")
+      }
+      close (fname)
+   }
+}'
@@ -0,0 +1,175 @@
+// vim: set ts=3 sw=3 colorcolumn=100 et
+
+// Generates l2h_tags.h, the perfect-hash table of known tagnames
+// used by l2h_main.c. The Makefile runs this whenever this file or
+// l2h_taghash.h changes; by hand it is:
+//    gcc -W -Wall -Wextra l2h_gentags.c -o l2h_gentags && ./l2h_gentags > l2h_tags.h
+
+/* ****************************************************************************
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Lelanthran Manickum
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * **************************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "l2h_taghash.h"
+
+/* ********************************************************
+ * The known tagnames and their classes. Anything not listed
+ * here is an ordinary element. Adding a builtin is a matter
+ * of adding it here and rebuilding.
+ */
+static const struct {
+   const char *name;
+   const char *cls;
+} known[] = {
+   { ".",            "tag_BUILTIN" },
+   { ".import",      "tag_BUILTIN" },
+   { ".raw",         "tag_BUILTIN" },
+
+   { "!DOCTYPE",     "tag_VOID" },
+   { "!doctype",     "tag_VOID" },
+   { "area",         "tag_VOID" },
+   { "base",         "tag_VOID" },
+   { "br",           "tag_VOID" },
+   { "col",          "tag_VOID" },
+   { "embed",        "tag_VOID" },
+   { "hr",           "tag_VOID" },
+   { "img",          "tag_VOID" },
+   { "input",        "tag_VOID" },
+   { "link",         "tag_VOID" },
+   { "meta",         "tag_VOID" },
+   { "param",        "tag_VOID" },
+   { "source",       "tag_VOID" },
+   { "track",        "tag_VOID" },
+   { "wbr",          "tag_VOID" },
+
+   { "script",       "tag_RAW_TEXT" },
+   { "style",        "tag_RAW_TEXT" },
+
+   // Ordinary, but common enough to be worth sharing between threads.
+   { "root", NULL },
+   { "a", NULL }, { "abbr", NULL }, { "address", NULL }, { "article", NULL },
+   { "aside", NULL }, { "audio", NULL }, { "b", NULL }, { "bdi", NULL }, { "bdo", NULL },
+   { "blockquote", NULL }, { "body", NULL }, { "button", NULL }, { "canvas", NULL },
+   { "caption", NULL }, { "cite", NULL }, { "code", NULL }, { "colgroup", NULL },
+   { "data", NULL }, { "datalist", NULL }, { "dd", NULL }, { "del", NULL },
+   { "details", NULL }, { "dfn", NULL }, { "dialog", NULL }, { "div", NULL },
+   { "dl", NULL }, { "dt", NULL }, { "em", NULL }, { "fieldset", NULL },
+   { "figcaption", NULL }, { "figure", NULL }, { "footer", NULL }, { "form", NULL },
+   { "h1", NULL }, { "h2", NULL }, { "h3", NULL }, { "h4", NULL }, { "h5", NULL },
+   { "h6", NULL }, { "head", NULL }, { "header", NULL }, { "hgroup", NULL },
+   { "html", NULL }, { "i", NULL }, { "iframe", NULL }, { "ins", NULL }, { "kbd", NULL },
+   { "label", NULL }, { "legend", NULL }, { "li", NULL }, { "main", NULL },
+   { "map", NULL }, { "mark", NULL }, { "menu", NULL }, { "meter", NULL },
+   { "nav", NULL }, { "noscript", NULL }, { "object", NULL }, { "ol", NULL },
+   { "optgroup", NULL }, { "option", NULL }, { "output", NULL }, { "p", NULL },
+   { "picture", NULL }, { "pre", NULL }, { "progress", NULL }, { "q", NULL },
+   { "rp", NULL }, { "rt", NULL }, { "ruby", NULL }, { "s", NULL }, { "samp", NULL },
+   { "search", NULL }, { "section", NULL }, { "select", NULL }, { "slot", NULL },
+   { "small", NULL }, { "span", NULL }, { "strong", NULL }, { "sub", NULL },
+   { "summary", NULL }, { "sup", NULL }, { "table", NULL }, { "tbody", NULL },
+   { "td", NULL }, { "template", NULL }, { "textarea", NULL }, { "tfoot", NULL },
+   { "th", NULL }, { "thead", NULL }, { "time", NULL }, { "title", NULL },
+   { "tr", NULL }, { "u", NULL }, { "ul", NULL }, { "var", NULL }, { "video", NULL },
+};
+static const size_t nknown = sizeof known / sizeof known[0];
+
+// The same hash and slot as tag_known() in l2h_main.c
+static size_t slot_of (uint32_t seed, const char *name, size_t nslots)
+{
+   uint32_t hash = taghash (seed, name, strlen (name));
+   return TAGHASH_SLOT (hash, nslots);
+}
+
+// Looks for a seed that sends every name to its own slot, doubling
+// the table whenever a size has had a fair number of tries.
+static bool find_seed (uint32_t *seed, size_t *nslots, uint16_t **slots)
+{
+   for (*nslots = 256; *nslots <= 65536; *nslots *= 2) {
+      if (!(*slots = calloc (*nslots, sizeof **slots))) {
+         fprintf (stderr, "OOM error allocating %zu slots\n", *nslots);
+         return false;
+      }
+
+      for (*seed = 1; *seed < 100000; (*seed)++) {
+         size_t i;
+         for (i=0; i<nknown; i++) {
+            uint16_t *slot = &(*slots)[slot_of (*seed, known[i].name, *nslots)];
+            if (*slot)
+               break;
+            *slot = i + 1;
+         }
+         if (i == nknown)
+            return true;
+         memset (*slots, 0, *nslots * sizeof **slots);
+      }
+      free (*slots);
+   }
+
+   fprintf (stderr, "No perfect hash found for %zu names\n", nknown);
+   return false;
+}
+
+int main (void)
+{
+   uint32_t seed;
+   size_t nslots;
+   uint16_t *slots;
+
+   if (!(find_seed (&seed, &nslots, &slots)))
+      return EXIT_FAILURE;
+
+   printf ("// Generated by l2h_gentags from l2h_gentags.c; do not edit.\n");
+   printf ("// %zu names, %zu slots.\n\n", nknown, nslots);
+   printf ("#define TAGCLASS_SEED     %uu\n", seed);
+   printf ("#define TAGCLASS_NSLOTS   %zu\n\n", nslots);
+
+   printf ("static const struct tag_t known_tags[] = {\n");
+   for (size_t i=0; i<nknown; i++) {
+      const char *n = known[i].name;
+      size_t len = strlen (n);
+      printf ("   { \"%s\", %zu, 0, \"<%s>\", %zu, \"</%s>\", %zu, %s },\n",
+              n, len, n, len + 2, n, len + 3, known[i].cls ? known[i].cls : "tag_ORDINARY");
+   }
+   printf ("};\n\n");
+
+   // Slots hold an index into known_tags plus one, so zero is empty.
+   printf ("static const %s tagclass_slots[TAGCLASS_NSLOTS] = {\n",
+           nknown < 255 ? "uint8_t" : "uint16_t");
+   for (size_t i=0; i<nslots; i++) {
+      if (slots[i])
+         printf ("   [%zu] = %u,\n", i, slots[i]);
+   }
+   printf ("};\n");
+
+   free (slots);
+   return EXIT_SUCCESS;
+}
@@ -1,7 +1,7 @@
 // vim: set ts=3 sw=3 colorcolumn=100 et
 
 // I compile with:
-//    gcc -c -W -Wall -Wextra -ggdb l2h_main.c -o l2h
+//    gcc -W -Wall -Wextra -ggdb l2h_main.c -o l2h -lpthread
 
 /* ****************************************************************************
  *
@@ -42,18 +42,34 @@
  * languages (Java, Python, etc) can use the library.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#if defined (__SSE2__) && !defined (__TINYC__)
+#include <emmintrin.h>
+#endif
 
 
 /* ********************************************************
@@ -64,16 +80,31 @@
 #define FPRINTF(x,...)  if (flag_verbose) fprintf (stderr, __VA_ARGS__)
 
 static bool flag_verbose = false;
+static bool flag_inode_order = false;
+static bool flag_escape = true;
+static bool flag_depfiles = false;
+static bool flag_watch = false;
+static bool flag_link_duplicates = false;
+static bool flag_text = false;
+static bool flag_manifest = false;
+static bool flag_pipeline = false;
+static const char *outdir = NULL;
+static FILE *depfile_outf = NULL;
+static FILE *index_outf = NULL;
+static FILE *tar_outf = NULL;
+static size_t njobs = 0;
+
+static const char *fext = ".html.lisp";
 
 static int getnextchar (const char *input, size_t input_len, size_t *index)
 {
-   if (*index > input_len)
+   if (*index >= input_len)
       return EOF;
 
    if (input[*index] == 0)
       return EOF;
 
-   int ret = input[*index];
+   int ret = (unsigned char)input[*index];
    (*index)++;
 
    return ret;
@@ -91,6 +122,11 @@ enum token_type_t {
    token_ATTR,
    token_WHITESPACE,
    token_NEWLINE,
+
+   // Only in token rings
+   token_RAW,
+   token_EOF,
+   token_ERROR,
 };
 
 #if 0
@@ -190,10 +226,30 @@ enum rstate_t {
    rstate_CONTENT,
 };
 
-static int token_read (struct token_t **dst, enum rstate_t *state,
+// The extent of a token within the input. The lexer only ever produces
+// these; token_read() turns them into a struct token_t for the parser.
+struct tokspan_t {
+   enum token_type_t type;
+   size_t start;
+   size_t len;
+};
+
+static int token_found (struct tokspan_t *dst, enum token_type_t type, size_t start, size_t len)
+{
+   dst->type = type;
+   dst->start = start;
+   dst->len = len;
+   return reader_TOKEN;
+}
+
+// Set in the lexer thread of a pipelined parse, whose errors are
+// reported when the parser goes over the input again without it.
+static _Thread_local bool lexer_quiet = false;
+
+static int token_next (struct tokspan_t *dst, enum rstate_t *state,
                        const char *input, size_t input_len, size_t *index)
 {
-   static char errbuf[1024];
+   char errbuf[1024];
    int c;
    while ((c = getnextchar (input, input_len, index)) != EOF) {
 
@@ -203,8 +259,7 @@ static int token_read (struct token_t **dst, enum rstate_t *state,
          if (*state == rstate_ATTRS) {
             return reader_CONTINUE;
          }
-         *dst = token_new (token_NEWLINE, &input[(*index) - 1], 1);
-         return reader_TOKEN;
+         return token_found (dst, token_NEWLINE, (*index) - 1, 1);
       }
 
       // Compress spaces that are not newlines
@@ -219,20 +274,20 @@ static int token_read (struct token_t **dst, enum rstate_t *state,
                 isspace (c)) {
             ;
          }
-         (*index)--;
-         *dst = token_new (token_WHITESPACE, &input[start], (*index) - start);
-         return reader_TOKEN;
+         // At the end of the input there is nothing to put back
+         if (c != EOF) {
+            (*index)--;
+         }
+         return token_found (dst, token_WHITESPACE, start, (*index) - start);
       }
 
       // Handle the open/close parenthesis cases
       if (c == '(') {
          *state = rstate_TAGNAME;
-         *dst = token_new (token_OPEN_PAREN, &input[(*index) - 1], 1);
-         return reader_TOKEN;
+         return token_found (dst, token_OPEN_PAREN, (*index) - 1, 1);
       }
       if (c == ')') {
-         *dst = token_new (token_CLOSE_PAREN, &input[(*index) - 1], 1);
-         return reader_TOKEN;
+         return token_found (dst, token_CLOSE_PAREN, (*index) - 1, 1);
       }
 
       // Handle element attributes, but not if we're reading content already
@@ -258,18 +313,21 @@ static int token_read (struct token_t **dst, enum rstate_t *state,
                if (c != quote) {
                   *index = start;
                   snprintf (errbuf, sizeof errbuf - 1, "%s", &input[*index]);
-                  fprintf (stderr, "Unmatched quote [%c] at\n%s\n", c, errbuf);
+                  if (!lexer_quiet) {
+                     fprintf (stderr, "Unmatched quote [%c] at\n%s\n", c, errbuf);
+                  }
                   return reader_ERROR;
                }
             }
          }
-         *dst = token_new (token_ATTR, &input[start], (*index) - start);
-         return reader_TOKEN;
+         return token_found (dst, token_ATTR, start, (*index) - start);
       }
 
       // If nothing else matches, then this is a symbol (content or tagname)
       // Maybe at some point in the future we use a static LUT for this.
-      if (isalpha (c) || ispunct (c)) {
+      // Bytes from 0x80 up are UTF-8 (the input has been validated), and
+      // are treated as letters.
+      if (isalpha (c) || ispunct (c) || c >= 0x80) {
          // If we are expecting a tagname, leave the state as it is, otherwise
          // from this point on we are expecting content only.
          if (*state != rstate_TAGNAME)
@@ -287,14 +345,15 @@ static int token_read (struct token_t **dst, enum rstate_t *state,
                break;
             }
          }
-         *dst = token_new (token_SYMBOL, &input[start], (*index) - start);
-         return reader_TOKEN;
+         return token_found (dst, token_SYMBOL, start, (*index) - start);
       }
 
       // Nothing matches?
-      snprintf (errbuf, sizeof errbuf - 1, "%s", &input[*index]);
-      fprintf (stderr, "No token matches succeeded at:\n");
-      fprintf (stderr, "--------\n%s\n---------\n", errbuf);
+      if (!lexer_quiet) {
+         snprintf (errbuf, sizeof errbuf - 1, "%s", &input[*index]);
+         fprintf (stderr, "No token matches succeeded at:\n");
+         fprintf (stderr, "--------\n%s\n---------\n", errbuf);
+      }
       return reader_ERROR;
    }
 
@@ -305,15 +364,275 @@ static int token_read (struct token_t **dst, enum rstate_t *state,
 
 
 
+static int token_read (struct token_t **dst, enum rstate_t *state,
+                       const char *input, size_t input_len, size_t *index)
+{
+   struct tokspan_t span;
+   int rc = token_next (&span, state, input, input_len, index);
+   if (rc == reader_TOKEN) {
+      if (!(*dst = token_new (span.type, &input[span.start], span.len))) {
+         return reader_ERROR;
+      }
+   }
+   return rc;
+}
+
+// Where the parser gets its tokens: from the lexer, run on the input as
+// the parser goes, or from a ring filled by a lexer thread (see
+// "Pipelined parsing"). The index is kept up to date either way, for
+// the messages about errors.
+struct tokfeed_t {
+   const char *input;
+   size_t input_len;
+   size_t *index;
+   struct tokring_t *ring;    // NULL to run the lexer here
+   size_t head;               // The next record in the ring
+   size_t tail;               // The end of the records known to be ready
+   bool abandoned;            // The ring ended early; the input must be parsed again
+};
+
+
+
+
+/* ********************************************************
+ * Verbatim literals:
+ *    (.raw DELIM body DELIM)
+ *
+ * DELIM is any run of non-whitespace characters and is
+ * followed by a single space or newline, which is not part of
+ * the body. The body is everything up to the first occurrence
+ * of DELIM that is followed by the closing ')', with nothing
+ * but whitespace between them. It is not tokenised at all, so
+ * it needs no escapes.
+ */
+
+// Finds the body of a verbatim literal, where *index is just after the
+// ".raw". On success *index is just after the closing ')'.
+static bool raw_find (const char *input, size_t input_len, size_t *index,
+                      size_t *body_start, size_t *body_len)
+{
+   size_t i = *index;
+
+   while (i < input_len && input[i] != '\n' && isspace ((unsigned char)input[i]))
+      i++;
+
+   const char *delim = &input[i];
+   while (i < input_len && !(isspace ((unsigned char)input[i])))
+      i++;
+   size_t delim_len = &input[i] - delim;
+   if (!delim_len || i >= input_len)
+      return false;
+
+   // Only an occurrence followed by the closing ')' ends the body, so
+   // the body may contain DELIM anywhere else
+   *body_start = ++i;
+   while (i < input_len) {
+      const char *found = memchr (&input[i], delim[0], input_len - i);
+      if (!found || (size_t)(found - input) + delim_len > input_len)
+         return false;
+      i = found - input + 1;
+      if ((memcmp (found, delim, delim_len)) != 0)
+         continue;
+
+      size_t close = found - input + delim_len;
+      while (close < input_len && isspace ((unsigned char)input[close]))
+         close++;
+      if (close < input_len && input[close] == ')') {
+         *body_len = found - &input[*body_start];
+         i = close;
+         break;
+      }
+   }
+   if (i >= input_len)
+      return false;
+
+   *index = i + 1;
+   return true;
+}
+
+
+
+
+/* ********************************************************
+ * struct tag_t
+ *
+ * Tagnames are interned so that every element with the same
+ * tagname shares one copy of it, together with its ready-made
+ * opening and closing tags. The common HTML elements and the
+ * builtins are in known_tags, generated at compile time into
+ * l2h_tags.h by l2h_gentags.c together with a perfect hash
+ * that finds them (and their class) in a single probe. That
+ * table is read-only and so is shared by all threads.
+ * Everything else goes into a table that belongs to the tree
+ * being parsed, and is an ordinary element.
+ */
+enum tag_class_t {
+   tag_ORDINARY = 0,
+   tag_BUILTIN,         // .import, .raw, etc
+   tag_VOID,            // Has no closing tag (br, meta, etc)
+   tag_RAW_TEXT,        // Content is not escaped (script, style)
+};
+
+struct tag_t {
+   char *name;
+   size_t name_len;
+   uint32_t hash;
+   char *open;          // "<name>"
+   size_t open_len;
+   char *close;         // "</name>"
+   size_t close_len;
+   enum tag_class_t cls;
+};
+
+struct tagtab_t {
+   struct tag_t **slots;
+   size_t nslots;
+   size_t ntags;
+};
+
+#include "l2h_taghash.h"
+#include "l2h_tags.h"
+
+static const struct tag_t *tag_known (const char *name, size_t name_len)
+{
+   uint32_t hash = taghash (TAGCLASS_SEED, name, name_len);
+
+   size_t slot = tagclass_slots[TAGHASH_SLOT (hash, TAGCLASS_NSLOTS)];
+   if (!slot)
+      return NULL;
+
+   const struct tag_t *ret = &known_tags[slot - 1];
+   return ret->name_len == name_len && (memcmp (ret->name, name, name_len)) == 0 ? ret : NULL;
+}
+
+static enum tag_class_t tag_class (const char *name)
+{
+   const struct tag_t *tag = tag_known (name, strlen (name));
+   return tag ? tag->cls : tag_ORDINARY;
+}
+
+static uint32_t tag_hash (const char *name, size_t name_len)
+{
+   return taghash (0, name, name_len);
+}
+
+static void tag_del (struct tag_t *tag)
+{
+   if (!tag)
+      return;
+
+   free (tag->name);
+   free (tag->open);
+   free (tag->close);
+   free (tag);
+}
+
+static struct tag_t *tag_new (const char *name, size_t name_len, uint32_t hash)
+{
+   struct tag_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      fprintf (stderr, "OOM error allocating tag\n");
+      return NULL;
+   }
+
+   ret->name = malloc (name_len + 1);
+   ret->open = malloc (name_len + 3);
+   ret->close = malloc (name_len + 4);
+   if (!ret->name || !ret->open || !ret->close) {
+      fprintf (stderr, "OOM error allocating tag [%s]\n", name);
+      tag_del (ret);
+      return NULL;
+   }
+
+   ret->name_len = name_len;
+   ret->hash = hash;
+   ret->open_len = name_len + 2;
+   ret->close_len = name_len + 3;
+   memcpy (ret->name, name, name_len + 1);
+   sprintf (ret->open, "<%s>", name);
+   sprintf (ret->close, "</%s>", name);
+   return ret;
+}
+
+static void tagtab_del (struct tagtab_t *tab)
+{
+   for (size_t i=0; i<tab->nslots; i++) {
+      tag_del (tab->slots[i]);
+   }
+   free (tab->slots);
+   memset (tab, 0, sizeof *tab);
+}
+
+// Returns the slot where the tag is, or where it should go. The table
+// is never full, so this always terminates.
+static struct tag_t **tagtab_slot (const struct tagtab_t *tab,
+                                   const char *name, size_t name_len, uint32_t hash)
+{
+   size_t mask = tab->nslots - 1;
+   for (size_t i=hash & mask; ; i=(i + 1) & mask) {
+      struct tag_t *tag = tab->slots[i];
+      if (!tag || (tag->hash == hash && tag->name_len == name_len
+                     && (memcmp (tag->name, name, name_len)) == 0)) {
+         return &tab->slots[i];
+      }
+   }
+}
+
+static bool tagtab_grow (struct tagtab_t *tab)
+{
+   struct tagtab_t newtab = { NULL, tab->nslots ? tab->nslots * 2 : 64, tab->ntags };
+   if (!(newtab.slots = calloc (newtab.nslots, sizeof *newtab.slots))) {
+      fprintf (stderr, "OOM error growing tag table\n");
+      return false;
+   }
+
+   for (size_t i=0; i<tab->nslots; i++) {
+      struct tag_t *tag = tab->slots[i];
+      if (tag) {
+         *tagtab_slot (&newtab, tag->name, tag->name_len, tag->hash) = tag;
+      }
+   }
+
+   free (tab->slots);
+   *tab = newtab;
+   return true;
+}
+
+static const struct tag_t *tagtab_add (struct tagtab_t *tab,
+                                       const char *name, size_t name_len, uint32_t hash)
+{
+   if ((tab->ntags + 1) * 2 > tab->nslots && !(tagtab_grow (tab)))
+      return NULL;
+
+   struct tag_t **slot = tagtab_slot (tab, name, name_len, hash);
+   if (!*slot) {
+      if (!(*slot = tag_new (name, name_len, hash)))
+         return NULL;
+      tab->ntags++;
+   }
+   return *slot;
+}
+
+// Returns the interned tag for name, adding it to tags if it is not
+// one of the known tags.
+static const struct tag_t *tag_intern (struct tagtab_t *tags, const char *name)
+{
+   size_t name_len = strlen (name);
+   const struct tag_t *ret = tag_known (name, name_len);
+
+   return ret ? ret : tagtab_add (tags, name, name_len, tag_hash (name, name_len));
+}
+
+
+
 /* ********************************************************
  * struct node_t
  */
 enum node_type_t {
    node_UNKNOWN = 0,
-   node_SYMBOL,
+   node_TEXT,
    node_LIST,
-   node_WHITESPACE,
-   node_NEWLINE,
+   node_RAW,
 };
 
 #if 0
@@ -324,10 +643,9 @@ static const char *node_type_text (enum node_type_t type)
       const char *text;
    } arr[] = {
       { node_UNKNOWN,      "node_UNKNOWN" },
-      { node_SYMBOL,       "node_SYMBOL"  },
+      { node_TEXT,         "node_TEXT"    },
       { node_LIST,         "node_LIST"    },
-      { node_WHITESPACE,   "node_WHITESPACE"    },
-      { node_NEWLINE,      "node_NEWLINE"    },
+      { node_RAW,          "node_RAW"    },
    };
    static const size_t arr_len = sizeof arr / sizeof arr[0];
 
@@ -341,9 +659,21 @@ static const char *node_type_text (enum node_type_t type)
 }
 #endif
 
+// The value of list nodes is the name of their (interned) tag and the
+// value of raw nodes is the body of a (.raw ...) form.
+//
+// Consecutive symbols, whitespace and newlines are kept together in a
+// single text node, with each gap written as a single space. The
+// positions of the newlines are recorded because the line following
+// each one is indented when emitted.
 struct node_t {
    enum node_type_t type;
+   const struct tag_t *tag;
    char *value;
+   size_t value_len;
+   size_t value_alloc;
+   size_t *newlines;
+   size_t nnewlines;
    char *attrs;
    size_t attrs_len;
    struct node_t **children;
@@ -360,7 +690,10 @@ static void node_del (struct node_t *node)
       node_del (node->children[i]);
    }
 
-   free (node->value);
+   if (!node->tag) {
+      free (node->value);
+   }
+   free (node->newlines);
    free (node->attrs);
    free (node->children);
    free (node);
@@ -377,7 +710,7 @@ static struct node_t *node_new (struct node_t *parent,
 
    ret->parent = parent;
    ret->type = type;
-   if (!(ret->value = strdup (value))) {
+   if (value && !(ret->value = strdup (value))) {
       fprintf (stderr, "OOM error allocating node->value\n");
       node_del (ret);
       return NULL;
@@ -397,6 +730,56 @@ static struct node_t *node_new (struct node_t *parent,
    return ret;
 }
 
+static struct node_t *node_new_list (struct node_t *parent, const struct tag_t *tag)
+{
+   struct node_t *ret = node_new (parent, node_LIST, NULL);
+   if (ret) {
+      ret->tag = tag;
+      ret->value = tag->name;
+   }
+   return ret;
+}
+
+// Appends to the text node at the end of parent, starting a new one if
+// the last child is something else.
+static bool node_add_text (struct node_t *parent,
+                           const char *text, size_t text_len, bool newline)
+{
+   struct node_t *node = parent->nchildren ? parent->children[parent->nchildren - 1] : NULL;
+   if (!node || node->type != node_TEXT) {
+      if (!(node = node_new (parent, node_TEXT, NULL)))
+         return false;
+   }
+
+   if (node->value_len + text_len + 1 > node->value_alloc) {
+      size_t newlen = node->value_alloc ? node->value_alloc * 2 : 64;
+      while (newlen < node->value_len + text_len + 1)
+         newlen *= 2;
+      char *tmp = realloc (node->value, newlen);
+      if (!tmp) {
+         fprintf (stderr, "OOM error growing text node\n");
+         return false;
+      }
+      node->value = tmp;
+      node->value_alloc = newlen;
+   }
+
+   if (newline) {
+      size_t *tmp = realloc (node->newlines, (node->nnewlines + 1) * sizeof *tmp);
+      if (!tmp) {
+         fprintf (stderr, "OOM error recording newline\n");
+         return false;
+      }
+      tmp[node->nnewlines++] = node->value_len;
+      node->newlines = tmp;
+   }
+
+   memcpy (&node->value[node->value_len], text, text_len);
+   node->value_len += text_len;
+   node->value[node->value_len] = 0;
+   return true;
+}
+
 static bool node_add_attr (struct node_t *node, const char *attr)
 {
    if (!node)
@@ -476,35 +859,151 @@ static bool node_is_final (const struct node_t *node)
 }
 #endif
 
+/* ********************************************************
+ * HTML escaping of content and attribute values. Most text
+ * has nothing that needs escaping, so the scan for the next
+ * special character is done 16 bytes at a time where SSE2 is
+ * available and everything before it is written in one go.
+ */
+static const char *escape_entity (char c)
+{
+   switch (c) {
+      case '&':   return "&amp;";
+      case '<':   return "&lt;";
+      case '>':   return "&gt;";
+      case '"':   return "&quot;";
+      case '\'':  return "&#39;";
+   }
+   return NULL;
+}
+
+// Returns the number of bytes before the first one that must be escaped.
+// Quotes are only escaped in attribute values.
+static size_t escape_span (const char *text, size_t text_len, bool attr)
+{
+   size_t i = 0;
+#if defined (__SSE2__) && !defined (__TINYC__)
+   const __m128i amp = _mm_set1_epi8 ('&');
+   const __m128i lt = _mm_set1_epi8 ('<');
+   const __m128i gt = _mm_set1_epi8 ('>');
+   const __m128i dquote = _mm_set1_epi8 (attr ? '"' : '&');
+   const __m128i squote = _mm_set1_epi8 (attr ? '\'' : '&');
+   for (; i + 16 <= text_len; i += 16) {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)&text[i]);
+      __m128i m = _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, amp),
+                                              _mm_cmpeq_epi8 (v, lt)),
+                                _mm_or_si128 (_mm_cmpeq_epi8 (v, gt),
+                                              _mm_or_si128 (_mm_cmpeq_epi8 (v, dquote),
+                                                            _mm_cmpeq_epi8 (v, squote))));
+      int mask = _mm_movemask_epi8 (m);
+      if (mask) {
+         return i + __builtin_ctz (mask);
+      }
+   }
+#endif
+   for (; i < text_len; i++) {
+      char c = text[i];
+      if (c == '&' || c == '<' || c == '>' || (attr && (c == '"' || c == '\''))) {
+         break;
+      }
+   }
+   return i;
+}
+
+static void emit_escaped (const char *text, size_t text_len, bool attr, FILE *outf)
+{
+   if (!flag_escape) {
+      fwrite (text, 1, text_len, outf);
+      return;
+   }
+
+   while (text_len) {
+      size_t span = escape_span (text, text_len, attr);
+      fwrite (text, 1, span, outf);
+      if (span == text_len)
+         break;
+      fputs (escape_entity (text[span]), outf);
+      text += span + 1;
+      text_len -= span + 1;
+   }
+}
+
+// The attributes are stored as they were written, so only the parts
+// after each '=' are escaped, keeping the original quotes.
+static void emit_attrs (const char *attrs, size_t attrs_len, FILE *outf)
+{
+   size_t i = 0;
+   while (i < attrs_len) {
+      const char *eq = memchr (&attrs[i], '=', attrs_len - i);
+      size_t nbytes = eq ? (size_t)(eq - &attrs[i]) + 1 : attrs_len - i;
+      fwrite (&attrs[i], 1, nbytes, outf);
+      i += nbytes;
+      if (i >= attrs_len)
+         break;
+
+      char quote = attrs[i];
+      if (quote != '"' && quote != '\'') {
+         emit_escaped (&attrs[i++], 1, true, outf);
+         continue;
+      }
+
+      const char *end = memchr (&attrs[i + 1], quote, attrs_len - i - 1);
+      size_t value_len = end ? (size_t)(end - &attrs[i + 1]) : attrs_len - i - 1;
+      fputc (quote, outf);
+      emit_escaped (&attrs[i + 1], value_len, true, outf);
+      i += value_len + 1;
+      if (end) {
+         fputc (quote, outf);
+         i++;
+      }
+   }
+}
+
 static void node_emit_html (const struct node_t *node, size_t indent, FILE *outf)
 {
    if (!node)
       return;
 
-   const char *attrs = NULL;
-   const char *delim = NULL;
    switch (node->type) {
-      case node_NEWLINE:
-         fprintf (outf, "\n");
-         print_indent (indent, outf);
-         break;
-
-      case node_WHITESPACE:
-         fprintf (outf, " ");
+      case node_TEXT:
+         for (size_t i=0, start=0; i<=node->nnewlines; i++) {
+            size_t end = i < node->nnewlines ? node->newlines[i] : node->value_len;
+            if (node->parent && node->parent->tag && node->parent->tag->cls == tag_RAW_TEXT) {
+               fwrite (&node->value[start], 1, end - start, outf);
+            } else {
+               emit_escaped (&node->value[start], end - start, false, outf);
+            }
+            if (i < node->nnewlines) {
+               fputc ('\n', outf);
+               print_indent (indent, outf);
+               start = end + 1;
+            }
+         }
          break;
 
-      case node_SYMBOL:
-         fprintf (outf, "%s", node->value);
+      case node_RAW:
+         if (node->parent && node->parent->tag && node->parent->tag->cls == tag_RAW_TEXT) {
+            fwrite (node->value, 1, strlen (node->value), outf);
+         } else {
+            emit_escaped (node->value, strlen (node->value), false, outf);
+         }
          break;
 
       case node_LIST:
-         attrs = node->attrs ? node->attrs : "";
-         delim = node->attrs ? " " : "";
-         fprintf (outf, "<%s%s%s>", node->value, delim, attrs);
+         if (node->attrs) {
+            fwrite (node->tag->open, 1, node->tag->open_len - 1, outf);
+            fputc (' ', outf);
+            emit_attrs (node->attrs, node->attrs_len, outf);
+            fputc ('>', outf);
+         } else {
+            fwrite (node->tag->open, 1, node->tag->open_len, outf);
+         }
          for (size_t i=0; i<node->nchildren; i++) {
             node_emit_html (node->children[i], indent + 1, outf);
          }
-         fprintf (outf, "</%s>", node->value);
+         if (node->tag->cls != tag_VOID) {
+            fwrite (node->tag->close, 1, node->tag->close_len, outf);
+         }
          break;
 
       case node_UNKNOWN:
@@ -517,187 +1016,3027 @@ static void node_emit_html (const struct node_t *node, size_t indent, FILE *outf
 
 
 
-static bool collect_input (char **dst, size_t *dst_len, const char *line);
-static int parse (struct node_t **dst,
+static int parser (struct node_t *parent, enum rstate_t state, struct tagtab_t *tags,
+                   struct tokfeed_t *feed);
+static int parse (struct node_t **dst, struct tagtab_t *tags,
                   const char *input, size_t input_len, size_t *index);
+static bool watch_add (const char *dpath, const char *ipath, bool recurse, const char *odir);
 
 
 /* ********************************************************
  * Main Functions
  */
 
-static int process_file (const char *ifname)
+static bool read_all (char **dst, size_t *dst_len, FILE *inf)
 {
-   static char line[1024 * 1024];
-   size_t nlines = 0;
-   char *input = NULL;
-   size_t input_len = 0;
-   struct node_t *root = NULL;
+   size_t nalloced = 0;
+   size_t nbytes;
 
-   int ret = EXIT_FAILURE;
-   FILE *inf = NULL, *outf = NULL;
-   char *ofname = NULL;
-   char *tmp = NULL;
+   do {
+      if (nalloced - *dst_len < 64 * 1024) {
+         size_t newlen = nalloced ? nalloced * 2 : 128 * 1024;
+         char *tmp = realloc (*dst, newlen + 1);
+         if (!tmp) {
+            return false;
+         }
+         *dst = tmp;
+         nalloced = newlen;
+      }
+      nbytes = fread (&(*dst)[*dst_len], 1, nalloced - *dst_len, inf);
+      *dst_len += nbytes;
+   } while (nbytes);
 
-   static const char *fext = ".html.lisp";
+   if (*dst)
+      (*dst)[*dst_len] = 0;
 
-   if (!ifname) {
-      fprintf (stderr, "%s: NULL passed for input filename\n", ifname);
-      goto cleanup;
-   }
+   return !(ferror (inf));
+}
 
-   if (!(ofname = strdup (ifname))) {
-      fprintf (stderr, "%s: OOM error allocating output filename\n", ifname);
-      goto cleanup;
-   }
+/* ********************************************************
+ * UTF-8 validation of the input. Runs of ASCII are skipped
+ * 16 bytes at a time where SSE2 is available, so only text
+ * that actually contains multi-byte sequences is examined a
+ * byte at a time.
+ */
 
-   // TODO: Fix this.
-   // If the input filename is "-", then set the output filename to "-"
-   // otherwise, set the output filename to the input filename, stripping
-   // off everything past ".html.lisp". This is non-ideal for files that
-   // have two instances of that string in their name, hence the TODO
-   if ((strcmp (ifname, "-")) == 0) {
-      free (ofname);
-      ofname = strdup ("-");
+// Returns the length of the valid UTF-8 sequence starting at the
+// (non-ASCII) first byte of text, or 0 if it is not valid. Overlong
+// encodings, surrogates and code points above U+10FFFF are invalid.
+static size_t utf8_seq_len (const unsigned char *text, size_t text_len)
+{
+   unsigned char lo = 0x80, hi = 0xbf;
+   size_t len;
+
+   if (text[0] >= 0xc2 && text[0] <= 0xdf) {
+      len = 2;
+   } else if (text[0] >= 0xe0 && text[0] <= 0xef) {
+      len = 3;
+      lo = text[0] == 0xe0 ? 0xa0 : 0x80;
+      hi = text[0] == 0xed ? 0x9f : 0xbf;
+   } else if (text[0] >= 0xf0 && text[0] <= 0xf4) {
+      len = 4;
+      lo = text[0] == 0xf0 ? 0x90 : 0x80;
+      hi = text[0] == 0xf4 ? 0x8f : 0xbf;
    } else {
-      tmp = strstr (ofname, fext);
-      if (!tmp) {
-         fprintf (stderr, "%s: Input filename missing [%s]\n", ifname, fext);
-         goto cleanup;
-      }
-      tmp = strstr (tmp, ".lisp"); // cannot fail, so omit the check
-       *tmp = 0;
+      return 0;
    }
 
-   if ((memcmp (ifname, "-", 2)) == 0) {
-      inf = stdin;
-   } else {
-      if (!(inf = fopen (ifname, "r"))) {
-         fprintf (stderr, "%s: opened\n", ifname);
-         fprintf (stderr, "%s: Failed to open [%s] for reading: %m\n", ifname, ifname);
-         goto cleanup;
-      }
-   }
+   if (text_len < len || text[1] < lo || text[1] > hi)
+      return 0;
 
-   if ((memcmp (ofname, "-", 2)) == 0) {
-      outf = stdout;
-   } else {
-      if (!(outf = fopen (ofname, "w"))) {
-         fprintf (stderr, "%s: opened\n", ofname);
-         fprintf (stderr, "%s: Failed to open [%s] for writing: %m\n", ifname, ofname);
-         goto cleanup;
-      }
+   for (size_t i=2; i<len; i++) {
+      if (text[i] < 0x80 || text[i] > 0xbf)
+         return 0;
    }
+   return len;
+}
 
-   while (!(feof (inf)) && !(ferror (inf)) && (fgets (line, sizeof line -1, inf))) {
-      nlines++;
-      if (!(collect_input (&input, &input_len, line))) {
-         fprintf (stderr, "%s: OOM error reading line %zu\n", ifname, nlines);
-         goto cleanup;
+// Returns the offset of the first byte that is not valid UTF-8, or
+// input_len if all of the input is valid.
+static size_t utf8_invalid_offset (const char *input, size_t input_len)
+{
+   const unsigned char *text = (const unsigned char *)input;
+   size_t i = 0;
+
+   while (i < input_len) {
+#if defined (__SSE2__) && !defined (__TINYC__)
+      while (i + 16 <= input_len
+               && !(_mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *)&text[i])))) {
+         i += 16;
+      }
+      if (i >= input_len)
+         break;
+#endif
+      if (text[i] < 0x80) {
+         i++;
+         continue;
       }
+      size_t len = utf8_seq_len (&text[i], input_len - i);
+      if (!len)
+         return i;
+      i += len;
    }
+   return input_len;
+}
 
-   size_t index = 0;
-   input_len = strlen (input);
-   int rc = parse (&root, input, input_len,  &index);
-   if (rc < 0) {
-      fprintf (stderr, "%s: Failed to parse input, aborting\n", ifname);
-      goto cleanup;
-   }
-   if (rc == 0) {
-      FPRINTF (stderr, "%s: complete\n", ifname);
-   }
-   if (rc > 0) {
-      fprintf (stderr, "%s: Unparsed input still in buffer\n", ifname);
-      goto cleanup;
-   }
+// Returns true if name ends with fext and has something in front of it.
+static bool fext_match (const char *name)
+{
+   size_t name_len = strlen (name);
+   size_t fext_len = strlen (fext);
 
-   for (size_t i=0; i<root->nchildren; i++) {
-      node_emit_html(root->children[i], 0, outf);
-   }
+   return name_len > fext_len && (memcmp (&name[name_len - fext_len], fext, fext_len)) == 0;
+}
 
-   ret = EXIT_SUCCESS;
-cleanup:
-   if (inf && (strcmp (ifname, "-") != 0)) {
-      fclose (inf);
-   }
-   if (outf && (strcmp (ofname, "-") != 0)) {
-      fclose (outf);
+// Opens name relative to dirfd, returning a stdio stream for it. The
+// dirfd can be AT_FDCWD to open name relative to the current directory.
+// Files opened for writing are always new files: an earlier run with
+// --link-duplicates may have left name hardlinked to other outputs,
+// and truncating it would write through to all of them.
+static FILE *fopenat (int dirfd, const char *name, const char *mode)
+{
+   int flags = O_RDONLY;
+   if (mode[0] != 'r') {
+      if ((unlinkat (dirfd, name, 0)) != 0 && errno != ENOENT)
+         return NULL;
+      flags = O_WRONLY | O_CREAT | O_EXCL;
    }
+   int fd = openat (dirfd, name, flags | O_CLOEXEC, 0666);
+   if (fd < 0)
+      return NULL;
 
-   free (ofname);
-
-   node_del (root);
-   if (!nlines) {
-      fprintf (stderr, "%s: No input provided. See the documentation for help\n", ifname);
-      goto cleanup;
+   FILE *ret = fdopen (fd, mode);
+   if (!ret) {
+      close (fd);
    }
-
-   free (input);
    return ret;
 }
 
-static int process_dir (const char *ifname, bool recurse)
+/* ********************************************************
+ * Depfiles, in the format that both make and ninja read:
+ *    output: input import1 import2 ...
+ */
+static void depfile_write_path (FILE *outf, const char *path, size_t path_len)
 {
-   int errcount = 1;
-   char *pwd = getcwd (NULL, 0); // gnu extension, allocates the returned value
-   struct dirent *de = NULL;
-   DIR *dirp = NULL;
-
-   if ((chdir (ifname)) != 0) {
-      fprintf (stderr, "Failed to switch to directory [%s]: %m\n", ifname);
-      goto cleanup;
+   for (size_t i=0; i<path_len; i++) {
+      switch (path[i]) {
+         case ' ':
+         case '#':
+         case '\\':   fputc ('\\', outf);   break;
+         case '$':      fputc ('$', outf);    break;
+      }
+      fputc (path[i], outf);
+   }
+}
+
+// Writes the target of every (.import ...) in the tree as a dependency.
+// Relative targets are relative to the directory of the importing file,
+// whose path (including the trailing '/') is the first idir_len bytes
+// of ipath.
+static void depfile_write_imports (FILE *outf, const char *ipath, size_t idir_len,
+                                   const struct node_t *node)
+{
+   if (node->type != node_LIST)
+      return;
+
+   if ((strcmp (node->value, ".import")) != 0) {
+      for (size_t i=0; i<node->nchildren; i++) {
+         depfile_write_imports (outf, ipath, idir_len, node->children[i]);
+      }
+      return;
+   }
+
+   char target[PATH_MAX];
+   size_t target_len = 0;
+   for (size_t i=0; i<node->nchildren; i++) {
+      const struct node_t *child = node->children[i];
+      const char *part = child->type == node_TEXT ? child->value : " ";
+      int nbytes = snprintf (&target[target_len], sizeof target - target_len, "%s", part);
+      if (nbytes < 0 || (size_t)nbytes >= sizeof target - target_len) {
+         fprintf (stderr, "%s: import target too long, omitted from depfile\n", ipath);
+         return;
+      }
+      for (size_t j=0; j<child->nnewlines; j++) {
+         target[target_len + child->newlines[j]] = ' ';
+      }
+      target_len += nbytes;
+   }
+
+   const char *start = target;
+   while (target_len && isspace (start[target_len - 1]))
+      target_len--;
+   if (target_len >= 2 && (start[0] == '"' || start[0] == '\'')
+                       && start[target_len - 1] == start[0]) {
+      start++;
+      target_len -= 2;
+   }
+   if (!target_len)
+      return;
+
+   fprintf (outf, " \\\n ");
+   if (start[0] != '/') {
+      depfile_write_path (outf, ipath, idir_len);
+   }
+   depfile_write_path (outf, start, target_len);
+}
+
+// Returns the dependencies from the imports in the tree, already
+// formatted for the depfile, or NULL on error.
+static char *depfile_imports (const char *ipath, const struct node_t *root)
+{
+   const char *idir_end = strrchr (ipath, '/');
+   size_t idir_len = idir_end ? (size_t)(idir_end - ipath) + 1 : 0;
+   char *ret = NULL;
+   size_t ret_len = 0;
+
+   FILE *outf = open_memstream (&ret, &ret_len);
+   if (!outf) {
+      fprintf (stderr, "%s: OOM error allocating depfile buffer\n", ipath);
+      return NULL;
+   }
+   depfile_write_imports (outf, ipath, idir_len, root);
+   if ((fclose (outf)) != 0) {
+      fprintf (stderr, "%s: OOM error writing depfile buffer\n", ipath);
+      free (ret);
+      return NULL;
+   }
+   return ret;
+}
+
+static void depfile_write (FILE *outf, const char *opath, const char *ipath,
+                           const char *imports)
+{
+   depfile_write_path (outf, opath, strlen (opath));
+   fprintf (outf, ": ");
+   depfile_write_path (outf, ipath, strlen (ipath));
+   fprintf (outf, "%s\n", imports);
+}
+
+// Writes the "-MD" depfile next to the output file, and appends the
+// same rule to the "-MF" depfile.
+static bool write_depfiles (int dirfd, const char *ofname, const char *opath,
+                            const char *ipath, const char *imports)
+{
+   char *dfname = NULL;
+   FILE *dfile = NULL;
+   bool ret = false;
+
+   if (flag_depfiles && !tar_outf) {
+      if (!(dfname = malloc (strlen (ofname) + 3))) {
+         fprintf (stderr, "%s: OOM error allocating depfile name\n", ipath);
+         goto cleanup;
+      }
+      strcpy (dfname, ofname);
+      strcat (dfname, ".d");
+
+      if (!(dfile = fopenat (dirfd, dfname, "w"))) {
+         fprintf (stderr, "%s: Failed to open depfile [%s] for writing: %m\n", ipath, dfname);
+         goto cleanup;
+      }
+      depfile_write (dfile, opath, ipath, imports);
+   }
+
+   if (depfile_outf) {
+      depfile_write (depfile_outf, opath, ipath, imports);
+   }
+
+   ret = true;
+cleanup:
+   if (dfile) {
+      fclose (dfile);
+   }
+   free (dfname);
+   return ret;
+}
+
+/* ********************************************************
+ * Side outputs, gathered from the tree in the same pass: the
+ * plain text of each page (--text), a JSON manifest of its
+ * title, headings and links (--manifest), and both for every
+ * page as a line of NDJSON (--index).
+ *
+ * Each tree is first reduced to a list of records, one per line,
+ * so that the lists of the segments of a split document can be
+ * joined like their output is:
+ *    T<text>                 Content
+ *    B                       A break between words
+ *    H<level> ... h          A heading
+ *    I ... i                 The title
+ *    L<tag>\t<attr>\t<url>   An href or src attribute
+ */
+struct pageinfo_t {
+   char *text;
+   size_t text_len;
+   char *title;               // NULL if the page has none
+   size_t title_len;
+   char *headings;            // JSON objects, each preceded by ','
+   size_t headings_len;
+   char *links;               // JSON objects, each preceded by ','
+   size_t links_len;
+};
+
+// Whitespace is collapsed to single spaces, and dropped at either end.
+struct textbuf_t {
+   FILE *outf;
+   bool space;
+   bool empty;
+};
+
+// Elements that do not break the words around them
+static bool text_inline (const char *name)
+{
+   static const char *names[] = {
+      "a", "abbr", "b", "bdi", "bdo", "cite", "code", "data", "del", "dfn", "em", "i",
+      "ins", "kbd", "mark", "q", "s", "samp", "small", "span", "strong", "sub", "sup",
+      "time", "u", "var",
+   };
+   for (size_t i=0; i<sizeof names / sizeof names[0]; i++) {
+      if ((strcmp (name, names[i])) == 0)
+         return true;
+   }
+   return false;
+}
+
+// Writes the rest of a record. Newlines in the text become spaces.
+static void extract_line (FILE *outf, const char *text, size_t text_len)
+{
+   while (text_len) {
+      const char *nl = memchr (text, '\n', text_len);
+      size_t span = nl ? (size_t)(nl - text) : text_len;
+      fwrite (text, 1, span, outf);
+      if (!nl)
+         break;
+      fputc (' ', outf);
+      text += span + 1;
+      text_len -= span + 1;
+   }
+   fputc ('\n', outf);
+}
+
+// The attributes are as they were written (less the ':'), each preceded
+// by a space. Quoted values may contain spaces.
+static void extract_links (FILE *outf, const struct node_t *node)
+{
+   const char *attrs = node->attrs;
+   size_t i = 0;
+   while (i < node->attrs_len) {
+      while (i < node->attrs_len && attrs[i] == ' ')
+         i++;
+      size_t name = i;
+      while (i < node->attrs_len && attrs[i] != '=' && attrs[i] != ' ')
+         i++;
+      size_t name_len = i - name;
+
+      size_t value = i, value_len = 0;
+      if (i < node->attrs_len && attrs[i] == '=') {
+         char quote = attrs[++i];
+         if (quote == '"' || quote == '\'') {
+            value = ++i;
+            const char *end = memchr (&attrs[i], quote, node->attrs_len - i);
+            value_len = end ? (size_t)(end - &attrs[i]) : node->attrs_len - i;
+            i += value_len + 1;
+         } else {
+            value = i;
+            while (i < node->attrs_len && attrs[i] != ' ')
+               i++;
+            value_len = i - value;
+         }
+      }
+
+      if ((name_len == 4 && (memcmp (&attrs[name], "href", 4)) == 0)
+            || (name_len == 3 && (memcmp (&attrs[name], "src", 3)) == 0)) {
+         fprintf (outf, "L%s\t%.*s\t", node->value, (int)name_len, &attrs[name]);
+         extract_line (outf, &attrs[value], value_len);
+      }
+   }
+}
+
+static void extract_walk (FILE *outf, const struct node_t *node)
+{
+   switch (node->type) {
+      case node_TEXT:
+         fputc ('T', outf);
+         extract_line (outf, node->value, node->value_len);
+         return;
+
+      case node_RAW:
+         fputc ('T', outf);
+         extract_line (outf, node->value, strlen (node->value));
+         return;
+
+      case node_LIST:
+         break;
+
+      case node_UNKNOWN:
+      default:
+         return;
+   }
+
+   // Imports, scripts and styles are not content
+   const struct tag_t *tag = node->tag;
+   if (tag->cls == tag_BUILTIN || tag->cls == tag_RAW_TEXT)
+      return;
+
+   if (node->attrs) {
+      extract_links (outf, node);
+   }
+
+   if (tag->cls == tag_VOID) {
+      fputs ("B\n", outf);
+      return;
+   }
+
+   const char *name = node->value;
+   bool block = !(text_inline (name));
+   bool heading = name[0] == 'h' && name[1] >= '1' && name[1] <= '6' && !name[2];
+   bool title = (strcmp (name, "title")) == 0;
+
+   if (block) {
+      fputs ("B\n", outf);
+   }
+   if (heading) {
+      fprintf (outf, "H%c\n", name[1]);
+   }
+   if (title) {
+      fputs ("I\n", outf);
+   }
+   for (size_t i=0; i<node->nchildren; i++) {
+      extract_walk (outf, node->children[i]);
+   }
+   if (title) {
+      fputs ("i\n", outf);
+   }
+   if (heading) {
+      fputs ("h\n", outf);
+   }
+   if (block) {
+      fputs ("B\n", outf);
+   }
+}
+
+// Returns the records for the tree, or NULL on error. The root itself
+// is not an element and breaks no words, so that the records of the
+// segments of a split document join up to those of the whole.
+static char *extract_records (const char *ipath, const struct node_t *root)
+{
+   char *ret = NULL;
+   size_t ret_len = 0;
+
+   FILE *outf = open_memstream (&ret, &ret_len);
+   if (!outf) {
+      fprintf (stderr, "%s: OOM error allocating side output buffer\n", ipath);
+      return NULL;
+   }
+   for (size_t i=0; i<root->nchildren; i++) {
+      extract_walk (outf, root->children[i]);
+   }
+   if ((fclose (outf)) != 0) {
+      fprintf (stderr, "%s: OOM error writing side output buffer\n", ipath);
+      free (ret);
+      return NULL;
+   }
+   return ret;
+}
+
+static void textbuf_put (struct textbuf_t *buf, const char *text, size_t text_len)
+{
+   size_t i = 0;
+   while (i < text_len) {
+      size_t start = i;
+      while (i < text_len && !(isspace ((unsigned char)text[i])))
+         i++;
+      if (i > start) {
+         if (buf->space && !buf->empty) {
+            fputc (' ', buf->outf);
+         }
+         fwrite (&text[start], 1, i - start, buf->outf);
+         buf->space = false;
+         buf->empty = false;
+      }
+      while (i < text_len && isspace ((unsigned char)text[i])) {
+         buf->space = true;
+         i++;
+      }
+   }
+}
+
+static void json_write_string (FILE *outf, const char *text, size_t text_len)
+{
+   fputc ('"', outf);
+   for (size_t i=0, start=0; i<=text_len; i++) {
+      unsigned char c = i < text_len ? text[i] : '"';
+      if (c != '"' && c != '\\' && c >= 0x20)
+         continue;
+      fwrite (&text[start], 1, i - start, outf);
+      start = i + 1;
+      if (i == text_len)
+         break;
+      if (c < 0x20) {
+         fprintf (outf, "\\u%04x", c);
+      } else {
+         fputc ('\\', outf);
+         fputc (c, outf);
+      }
+   }
+   fputc ('"', outf);
+}
+
+static void pageinfo_del (struct pageinfo_t *info)
+{
+   free (info->text);
+   free (info->title);
+   free (info->headings);
+   free (info->links);
+   memset (info, 0, sizeof *info);
+}
+
+// Collects the page text, title, headings and links from the records.
+// Only the first title is kept, and headings within headings are part
+// of the outer one.
+static bool pageinfo_read (struct pageinfo_t *info, const char *ipath, const char *records)
+{
+   struct textbuf_t text = { NULL, false, true };
+   struct textbuf_t title = { NULL, false, true };
+   struct textbuf_t heading = { NULL, false, true };
+   char *heading_text = NULL;
+   size_t heading_len = 0;
+   size_t heading_depth = 0;
+   char heading_level = 0;
+   FILE *headingsf = NULL, *linksf = NULL;
+   bool in_title = false, ret = false;
+
+   memset (info, 0, sizeof *info);
+   if (!(text.outf = open_memstream (&info->text, &info->text_len))
+         || !(headingsf = open_memstream (&info->headings, &info->headings_len))
+         || !(linksf = open_memstream (&info->links, &info->links_len))) {
+      fprintf (stderr, "%s: OOM error allocating side output buffers\n", ipath);
+      goto cleanup;
+   }
+
+   for (const char *rec=records; *rec; ) {
+      const char *end = strchr (rec, '\n');
+      size_t len = end ? (size_t)(end - rec) : strlen (rec);
+
+      switch (rec[0]) {
+         case 'T':
+            if (in_title) {
+               if (title.outf) {
+                  textbuf_put (&title, &rec[1], len - 1);
+               }
+               break;
+            }
+            textbuf_put (&text, &rec[1], len - 1);
+            if (heading.outf) {
+               textbuf_put (&heading, &rec[1], len - 1);
+            }
+            break;
+
+         case 'B':
+            text.space = true;
+            heading.space = true;
+            break;
+
+         case 'H':
+            if (heading_depth++)
+               break;
+            heading_level = rec[1];
+            heading.space = false;
+            heading.empty = true;
+            if (!(heading.outf = open_memstream (&heading_text, &heading_len))) {
+               fprintf (stderr, "%s: OOM error allocating heading buffer\n", ipath);
+               goto cleanup;
+            }
+            break;
+
+         case 'h':
+            if (!heading_depth || --heading_depth)
+               break;
+            if ((fclose (heading.outf)) != 0) {
+               heading.outf = NULL;
+               fprintf (stderr, "%s: OOM error writing heading buffer\n", ipath);
+               goto cleanup;
+            }
+            heading.outf = NULL;
+            fprintf (headingsf, ",{\"level\":%c,\"text\":", heading_level);
+            json_write_string (headingsf, heading_text, heading_len);
+            fputc ('}', headingsf);
+            free (heading_text);
+            heading_text = NULL;
+            break;
+
+         case 'I':
+            in_title = true;
+            if (!info->title && !(title.outf = open_memstream (&info->title, &info->title_len))) {
+               fprintf (stderr, "%s: OOM error allocating title buffer\n", ipath);
+               goto cleanup;
+            }
+            break;
+
+         case 'i':
+            in_title = false;
+            if (title.outf && (fclose (title.outf)) != 0) {
+               title.outf = NULL;
+               fprintf (stderr, "%s: OOM error writing title buffer\n", ipath);
+               goto cleanup;
+            }
+            title.outf = NULL;
+            break;
+
+         case 'L': {
+            const char *tag = &rec[1];
+            const char *attr = memchr (tag, '\t', len - 1);
+            const char *url = attr ? memchr (attr + 1, '\t', &rec[len] - attr - 1) : NULL;
+            if (!url)
+               break;
+            fputs (",{\"tag\":", linksf);
+            json_write_string (linksf, tag, attr - tag);
+            fputs (",\"attr\":", linksf);
+            json_write_string (linksf, attr + 1, url - attr - 1);
+            fputs (",\"url\":", linksf);
+            json_write_string (linksf, url + 1, &rec[len] - url - 1);
+            fputc ('}', linksf);
+            break;
+         }
+      }
+
+      rec += len + (end ? 1 : 0);
+   }
+
+   ret = true;
+cleanup:
+   if (heading.outf) {
+      fclose (heading.outf);
+   }
+   free (heading_text);
+   if (title.outf && (fclose (title.outf)) != 0) {
+      ret = false;
+   }
+   if (linksf && (fclose (linksf)) != 0) {
+      ret = false;
+   }
+   if (headingsf && (fclose (headingsf)) != 0) {
+      ret = false;
+   }
+   if (text.outf && (fclose (text.outf)) != 0) {
+      ret = false;
+   }
+   if (!ret) {
+      pageinfo_del (info);
+   }
+   return ret;
+}
+
+// Writes the manifest of the page as a single line of JSON, including
+// the text of the page if with_text is set.
+static void pageinfo_write_json (FILE *outf, const struct pageinfo_t *info,
+                                 const char *opath, const char *ipath, bool with_text)
+{
+   fputs ("{\"page\":", outf);
+   json_write_string (outf, opath, strlen (opath));
+   fputs (",\"source\":", outf);
+   json_write_string (outf, ipath, strlen (ipath));
+   fputs (",\"title\":", outf);
+   if (info->title) {
+      json_write_string (outf, info->title, info->title_len);
+   } else {
+      fputs ("null", outf);
+   }
+   fprintf (outf, ",\"headings\":[%s]", info->headings_len ? &info->headings[1] : "");
+   fprintf (outf, ",\"links\":[%s]", info->links_len ? &info->links[1] : "");
+   if (with_text) {
+      fputs (",\"text\":", outf);
+      json_write_string (outf, info->text, info->text_len);
+   }
+   fputs ("}\n", outf);
+}
+
+// Writes the "--text" (json false) or "--manifest" (json true) file
+// next to the output file.
+static bool write_side_file (int dirfd, const char *ofname, const char *opath,
+                             const char *ipath, const struct pageinfo_t *info, bool json)
+{
+   size_t sfname_len = strlen (ofname) + 6;
+   char *sfname = malloc (sfname_len);
+   FILE *sfile = NULL;
+   bool ret = false;
+
+   if (!sfname) {
+      fprintf (stderr, "%s: OOM error allocating side output filename\n", ipath);
+      goto cleanup;
+   }
+   snprintf (sfname, sfname_len, "%s.%s", ofname, json ? "json" : "txt");
+
+   if (!(sfile = fopenat (dirfd, sfname, "w"))) {
+      fprintf (stderr, "%s: Failed to open [%s] for writing: %m\n", ipath, sfname);
+      goto cleanup;
+   }
+   if (json) {
+      pageinfo_write_json (sfile, info, opath, ipath, false);
+   } else if (info->text_len) {
+      fwrite (info->text, 1, info->text_len, sfile);
+      fputc ('\n', sfile);
+   }
+
+   ret = true;
+cleanup:
+   if (sfile && (fclose (sfile)) != 0) {
+      fprintf (stderr, "%s: Failed to write [%s]: %m\n", ipath, sfname);
+      ret = false;
+   }
+   free (sfname);
+   return ret;
+}
+
+// Writes the "--text" and "--manifest" files next to the output file,
+// and appends the page to the "--index" file. Output that has no file
+// (ofname is NULL) only goes to the index.
+static bool write_side_outputs (int dirfd, const char *ofname, const char *opath,
+                                const char *ipath, const char *records)
+{
+   struct pageinfo_t info;
+   bool files = ofname && !tar_outf;
+   bool ret = false;
+
+   if (!(pageinfo_read (&info, ipath, records)))
+      return false;
+
+   if (flag_text && files && !(write_side_file (dirfd, ofname, opath, ipath, &info, false))) {
+      goto cleanup;
+   }
+   if (flag_manifest && files && !(write_side_file (dirfd, ofname, opath, ipath, &info, true))) {
+      goto cleanup;
+   }
+   if (index_outf) {
+      pageinfo_write_json (index_outf, &info, opath, ipath, true);
+   }
+
+   ret = true;
+cleanup:
+   pageinfo_del (&info);
+   return ret;
+}
+
+/* ********************************************************
+ * Large documents are split at the boundaries between their
+ * top-level forms, and the segments are parsed and emitted by
+ * a pool of threads. The output of each segment is held in
+ * memory until all the segments before it have been written,
+ * so the result is identical to converting the document in one
+ * piece.
+ */
+#define SPLIT_MIN_SEGMENT     (1024 * 1024)
+
+struct segment_t {
+   size_t start;
+   size_t end;
+   enum rstate_t state;
+   char *output;
+   size_t output_len;
+   char *imports;
+   char *extract;
+   int rc;
+   bool done;
+};
+
+// Where a scan of a changed document can stop: any boundary at or after
+// from that is also in bounds (which is sorted) once delta is taken off,
+// because everything after it is unchanged. The delta is the change in
+// length, modulo SIZE_MAX + 1 when the document got shorter.
+struct split_sync_t {
+   size_t from;
+   size_t delta;
+   const size_t *bounds;
+   size_t nbounds;
+};
+
+struct split_t {
+   const char *input;
+   const char *ipath;
+   bool want_imports;
+   bool want_extract;
+   struct segment_t *segments;
+   size_t nsegments;
+   size_t next;
+   bool failed;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+};
+
+// Checks the tagname the same way that the parser will, and reports
+// whether it starts a verbatim literal.
+static bool split_tag_valid (const char *tag, size_t tag_len, bool *is_raw)
+{
+   *is_raw = false;
+   if (tag[0] != '.' && tag[0] != '\\')
+      return true;
+
+   struct token_t *tok = token_new (token_SYMBOL, tag, tag_len);
+   bool ret = tok && (tok->text[0] != '.' || tag_class (tok->text) == tag_BUILTIN);
+   *is_raw = ret && (strcmp (tok->text, ".raw")) == 0;
+   token_del (tok);
+   return ret;
+}
+
+static bool split_synced (const struct split_sync_t *sync, size_t index)
+{
+   if (!sync || index < sync->from)
+      return false;
+
+   // Past sync->from this cannot go below zero, even if delta is negative
+   size_t target = index - sync->delta;
+   size_t lo = 0, hi = sync->nbounds;
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (sync->bounds[mid] == target)
+         return true;
+      if (sync->bounds[mid] < target) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   return false;
+}
+
+// Finds the offsets at which the document can be split between top-level
+// forms so that each segment is at least seg_len bytes long. This runs
+// the same lexer as the parser, and consumes the tagname after each '('
+// the same way that the parser does, so each segment parses exactly as
+// it would have as part of the whole document. Returns false when the
+// document must not be split, which includes any input that the parser
+// would report an error on.
+//
+// The scan begins at start, which must be 0 or a previously found
+// boundary, and stops early at the first boundary matched by sync (if
+// sync is not NULL).
+static bool split_scan (size_t **dst, size_t *dst_len,
+                        const char *input, size_t input_len, size_t start, size_t seg_len,
+                        const struct split_sync_t *sync)
+{
+   enum rstate_t *states = NULL;
+   size_t nstates = 0;
+   size_t depth = 0;
+   size_t index = start;
+   size_t last = start;
+   size_t nalloced = 0;
+   struct tokspan_t span;
+   bool ret = false;
+   int rc, c;
+
+   if (!(states = malloc ((nstates = 64) * (sizeof *states))))
+      return false;
+
+   states[0] = start ? rstate_CONTENT : rstate_ERROR;
+
+   while ((rc = token_next (&span, &states[depth], input, input_len, &index)) != reader_EOF) {
+      if (rc == reader_CONTINUE)
+         continue;
+      if (rc != reader_TOKEN)
+         goto cleanup;
+
+      // A form that has just been closed may end a segment
+      bool closed = false;
+
+      if (span.type == token_CLOSE_PAREN) {
+         if (!depth)
+            goto cleanup;
+         states[--depth] = rstate_CONTENT;
+         closed = true;
+      }
+
+      if (span.type == token_OPEN_PAREN) {
+         // Whatever follows the '(' is the tagname, followed by the same
+         // whitespace swallowing that the parser does. Verbatim literals
+         // are skipped in one go.
+         bool is_raw;
+         size_t body_start, body_len;
+         if ((token_next (&span, &states[depth], input, input_len, &index)) != reader_TOKEN)
+            goto cleanup;
+         if (!(split_tag_valid (&input[span.start], span.len, &is_raw)))
+            goto cleanup;
+         if (is_raw) {
+            if (!(raw_find (input, input_len, &index, &body_start, &body_len)))
+               goto cleanup;
+            states[depth] = rstate_CONTENT;
+            closed = true;
+         } else {
+            while ((c = getnextchar (input, input_len, &index))!=EOF) {
+               if ((c == '\n') || !(isspace (c))) {
+                  index--;
+                  break;
+               }
+            }
+
+            if (++depth >= nstates) {
+               enum rstate_t *tmp = realloc (states, (nstates * 2) * (sizeof *tmp));
+               if (!tmp)
+                  goto cleanup;
+               states = tmp;
+               nstates *= 2;
+            }
+            states[depth] = rstate_ERROR;
+         }
+      }
+
+      if (!closed || depth || index - last < seg_len || index >= input_len)
+         continue;
+
+      if (*dst_len >= nalloced) {
+         size_t newlen = nalloced ? nalloced * 2 : 16;
+         size_t *tmp = realloc (*dst, newlen * (sizeof *tmp));
+         if (!tmp)
+            goto cleanup;
+         *dst = tmp;
+         nalloced = newlen;
+      }
+      (*dst)[(*dst_len)++] = last = index;
+
+      if (split_synced (sync, index)) {
+         ret = true;
+         goto cleanup;
+      }
+   }
+
+   ret = depth == 0;
+cleanup:
+   free (states);
+   return ret;
+}
+
+static void segment_convert (struct split_t *split, struct segment_t *seg)
+{
+   struct tagtab_t tags = { NULL, 0, 0 };
+   const struct tag_t *tag = tag_intern (&tags, "root");
+   struct node_t *root = tag ? node_new_list (NULL, tag) : NULL;
+   FILE *outf = NULL;
+   size_t index = seg->start;
+
+   seg->rc = -1;
+   if (!root) {
+      fprintf (stderr, "OOM error constructing root node\n");
+      return;
+   }
+
+   struct tokfeed_t feed = { split->input, seg->end, &index, NULL, 0, 0, false };
+   if ((parser (root, seg->state, &tags, &feed)) != 0) {
+      goto cleanup;
+   }
+
+   if (!(outf = open_memstream (&seg->output, &seg->output_len))) {
+      fprintf (stderr, "%s: Failed to allocate output buffer: %m\n", split->ipath);
+      goto cleanup;
+   }
+   for (size_t i=0; i<root->nchildren; i++) {
+      node_emit_html (root->children[i], 0, outf);
+   }
+   if ((fclose (outf)) != 0) {
+      fprintf (stderr, "%s: Failed to write output buffer: %m\n", split->ipath);
+      goto cleanup;
+   }
+
+   if (split->want_imports && !(seg->imports = depfile_imports (split->ipath, root))) {
+      goto cleanup;
+   }
+   if (split->want_extract && !(seg->extract = extract_records (split->ipath, root))) {
+      goto cleanup;
+   }
+
+   seg->rc = 0;
+cleanup:
+   node_del (root);
+   tagtab_del (&tags);
+}
+
+static void *split_worker (void *arg)
+{
+   struct split_t *split = arg;
+
+   while (1) {
+      pthread_mutex_lock (&split->lock);
+      size_t i = split->next++;
+      bool failed = split->failed;
+      pthread_mutex_unlock (&split->lock);
+
+      if (i >= split->nsegments)
+         break;
+
+      struct segment_t *seg = &split->segments[i];
+      if (!failed) {
+         segment_convert (split, seg);
+      }
+
+      pthread_mutex_lock (&split->lock);
+      seg->done = true;
+      split->failed = split->failed || seg->rc != 0;
+      pthread_cond_broadcast (&split->cond);
+      pthread_mutex_unlock (&split->lock);
+   }
+
+   return NULL;
+}
+
+// Starts up to njobs threads working on the segments. If none could be
+// started, the segments are all converted before this returns. Returns
+// the number of threads that must be joined.
+static size_t split_start (struct split_t *split, pthread_t *threads)
+{
+   size_t nthreads;
+   for (nthreads=0; nthreads<njobs && nthreads<split->nsegments; nthreads++) {
+      if ((pthread_create (&threads[nthreads], NULL, split_worker, split)) != 0) {
+         break;
+      }
+   }
+   if (!nthreads) {
+      split_worker (split);
+   }
+   return nthreads;
+}
+
+// Returns 1 if the document was not split (the caller must convert it),
+// 0 on success and -1 on error. On success *imports holds the depfile
+// dependencies of the document if they were asked for, and *extract the
+// side output records unless extract is NULL.
+static int split_convert (const char *input, size_t input_len, const char *ipath,
+                          bool want_imports, FILE *outf, char **imports, char **extract)
+{
+   size_t *bounds = NULL;
+   size_t nbounds = 0;
+   size_t seg_len = SPLIT_MIN_SEGMENT;
+   pthread_t *threads = NULL;
+   size_t nthreads = 0;
+   FILE *importsf = NULL;
+   size_t imports_len = 0;
+   FILE *extractf = NULL;
+   size_t extract_len = 0;
+   int ret = 1;
+
+   struct split_t split = {
+      .input = input,
+      .ipath = ipath,
+      .want_imports = want_imports,
+      .want_extract = extract != NULL,
+      .lock = PTHREAD_MUTEX_INITIALIZER,
+      .cond = PTHREAD_COND_INITIALIZER,
+   };
+
+   if (njobs < 2 || input_len < 2 * SPLIT_MIN_SEGMENT)
+      return 1;
+
+   if (input_len / (njobs * 4) > seg_len)
+      seg_len = input_len / (njobs * 4);
+
+   if (!(split_scan (&bounds, &nbounds, input, input_len, 0, seg_len, NULL)) || !nbounds)
+      goto cleanup;
+
+   ret = -1;
+   split.nsegments = nbounds + 1;
+   if (!(split.segments = calloc (split.nsegments, sizeof *split.segments))
+         || !(threads = calloc (njobs, sizeof *threads))
+         || (want_imports && !(importsf = open_memstream (imports, &imports_len)))
+         || (extract && !(extractf = open_memstream (extract, &extract_len)))) {
+      fprintf (stderr, "%s: OOM error allocating segments\n", ipath);
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<split.nsegments; i++) {
+      split.segments[i].start = i ? bounds[i - 1] : 0;
+      split.segments[i].end = i < nbounds ? bounds[i] : input_len;
+      split.segments[i].state = i ? rstate_CONTENT : rstate_ERROR;
+   }
+
+   FPRINTF (stderr, "%s: converting in %zu segments\n", ipath, split.nsegments);
+
+   nthreads = split_start (&split, threads);
+
+   bool failed = false;
+   for (size_t i=0; i<split.nsegments; i++) {
+      struct segment_t *seg = &split.segments[i];
+      pthread_mutex_lock (&split.lock);
+      while (!seg->done) {
+         pthread_cond_wait (&split.cond, &split.lock);
+      }
+      pthread_mutex_unlock (&split.lock);
+
+      failed = failed || seg->rc != 0;
+      if (!failed) {
+         fwrite (seg->output, 1, seg->output_len, outf);
+         if (importsf) {
+            fputs (seg->imports, importsf);
+         }
+         if (extractf) {
+            fputs (seg->extract, extractf);
+         }
+      }
+      free (seg->output);
+      free (seg->imports);
+      free (seg->extract);
+   }
+
+   for (size_t i=0; i<nthreads; i++) {
+      pthread_join (threads[i], NULL);
+   }
+
+   if (failed) {
+      fprintf (stderr, "%s: Failed to parse input, aborting\n", ipath);
+      goto cleanup;
+   }
+
+   ret = 0;
+cleanup:
+   if (importsf && (fclose (importsf)) != 0) {
+      ret = -1;
+   }
+   if (extractf && (fclose (extractf)) != 0) {
+      ret = -1;
+   }
+   free (threads);
+   free (split.segments);
+   free (bounds);
+   return ret;
+}
+
+/* ********************************************************
+ * Pipelined parsing, for --pipeline. A large document that is
+ * not split (usually one big (html ...) form) is lexed by a
+ * thread of its own, which passes token records to the parser
+ * through a ring with a single producer and a single consumer,
+ * so that neither side ever takes a lock.
+ *
+ * The lexer thread also does the parts of the lexing that the
+ * parser would do itself: the token after each '(' is the
+ * tagname, the whitespace after it is skipped, and the body
+ * of each (.raw ...) is found and passed on as a token_RAW.
+ *
+ * The ring ends with a token_EOF, or with a token_ERROR where
+ * the lexer found anything that split_scan() would not split,
+ * which includes every error. The parser then gives up without
+ * a word and the document is parsed again without the thread,
+ * so that errors are reported exactly as they always are.
+ */
+#define PIPE_MIN_INPUT     (64 * 1024)
+#define TOKRING_SIZE       (4096)      // Must be a power of two
+#define TOKRING_BATCH      (64)
+
+struct tokring_t {
+   struct tokspan_t spans[TOKRING_SIZE];
+   const char *input;
+   size_t input_len;
+   size_t start;
+
+   // Each side publishes its position once per batch, and before it
+   // waits for the other side.
+   _Alignas (64) atomic_size_t head;
+   atomic_bool stop;          // The parser wants no more records
+   _Alignas (64) atomic_size_t tail;
+};
+
+static void tokring_wait (unsigned *spins)
+{
+   if (++(*spins) > 100) {
+      sched_yield ();
+   }
+}
+
+// Returns false if the parser has stopped.
+static bool tokring_push (struct tokring_t *ring, size_t *tail, size_t *head,
+                          enum token_type_t type, size_t start, size_t len)
+{
+   unsigned spins = 0;
+   while (*tail - *head >= TOKRING_SIZE) {
+      atomic_store_explicit (&ring->tail, *tail, memory_order_release);
+      *head = atomic_load_explicit (&ring->head, memory_order_acquire);
+      if (atomic_load_explicit (&ring->stop, memory_order_relaxed))
+         return false;
+      if (*tail - *head >= TOKRING_SIZE) {
+         tokring_wait (&spins);
+      }
+   }
+
+   struct tokspan_t *span = &ring->spans[*tail & (TOKRING_SIZE - 1)];
+   span->type = type;
+   span->start = start;
+   span->len = len;
+   if (++(*tail) % TOKRING_BATCH == 0 || type == token_EOF || type == token_ERROR) {
+      atomic_store_explicit (&ring->tail, *tail, memory_order_release);
+   }
+   return true;
+}
+
+// Follows the state of the reader through the nesting of the forms the
+// same way that split_scan() does.
+static void *tokring_lexer (void *arg)
+{
+   struct tokring_t *ring = arg;
+   const char *input = ring->input;
+   size_t input_len = ring->input_len;
+   enum rstate_t *states = NULL;
+   size_t nstates = 64;
+   size_t depth = 0;
+   size_t index = ring->start;
+   size_t tail = 0, head = 0;
+   struct tokspan_t span, tag;
+   enum token_type_t end = token_ERROR;
+   int rc, c;
+
+   lexer_quiet = true;
+   if (!(states = malloc (nstates * (sizeof *states))))
+      goto cleanup;
+   states[0] = rstate_ERROR;
+
+   while ((rc = token_next (&span, &states[depth], input, input_len, &index)) != reader_EOF) {
+      if (rc == reader_CONTINUE)
+         continue;
+      if (rc != reader_TOKEN)
+         goto cleanup;
+
+      if (span.type == token_CLOSE_PAREN) {
+         if (!depth)
+            goto cleanup;
+         states[--depth] = rstate_CONTENT;
+      }
+
+      if (span.type != token_OPEN_PAREN) {
+         if (!(tokring_push (ring, &tail, &head, span.type, span.start, span.len)))
+            goto cleanup;
+         continue;
+      }
+
+      // An unfinished form at the end of the input is not an error
+      bool is_raw;
+      size_t body_start, body_len;
+      if ((rc = token_next (&tag, &states[depth], input, input_len, &index)) == reader_EOF) {
+         if (!(tokring_push (ring, &tail, &head, span.type, span.start, span.len)))
+            goto cleanup;
+         break;
+      }
+      if (rc != reader_TOKEN || !(split_tag_valid (&input[tag.start], tag.len, &is_raw)))
+         goto cleanup;
+      if (is_raw && !(raw_find (input, input_len, &index, &body_start, &body_len)))
+         goto cleanup;
+
+      if (!(tokring_push (ring, &tail, &head, span.type, span.start, span.len))
+            || !(tokring_push (ring, &tail, &head, tag.type, tag.start, tag.len)))
+         goto cleanup;
+
+      if (is_raw) {
+         if (!(tokring_push (ring, &tail, &head, token_RAW, body_start, body_len)))
+            goto cleanup;
+         states[depth] = rstate_CONTENT;
+         continue;
+      }
+
+      while ((c = getnextchar (input, input_len, &index))!=EOF) {
+         if ((c == '\n') || !(isspace (c))) {
+            index--;
+            break;
+         }
+      }
+
+      if (++depth >= nstates) {
+         enum rstate_t *tmp = realloc (states, (nstates * 2) * (sizeof *tmp));
+         if (!tmp)
+            goto cleanup;
+         states = tmp;
+         nstates *= 2;
+      }
+      states[depth] = rstate_ERROR;
+   }
+   end = token_EOF;
+
+cleanup:
+   tokring_push (ring, &tail, &head, end, index, 0);
+   free (states);
+   return NULL;
+}
+
+// Starts the lexer thread on the input from *index. Returns NULL, and
+// the parser runs the lexer itself, if the thread cannot be started.
+static struct tokring_t *tokring_start (pthread_t *thread,
+                                        const char *input, size_t input_len, size_t index)
+{
+   struct tokring_t *ring = aligned_alloc (64, sizeof *ring);
+   if (!ring)
+      return NULL;
+
+   ring->input = input;
+   ring->input_len = input_len;
+   ring->start = index;
+   atomic_init (&ring->head, 0);
+   atomic_init (&ring->tail, 0);
+   atomic_init (&ring->stop, false);
+   if ((pthread_create (thread, NULL, tokring_lexer, ring)) != 0) {
+      free (ring);
+      return NULL;
+   }
+   return ring;
+}
+
+static void tokring_end (struct tokring_t *ring, pthread_t thread)
+{
+   atomic_store_explicit (&ring->stop, true, memory_order_relaxed);
+   pthread_join (thread, NULL);
+   free (ring);
+}
+
+// The last record (token_EOF or token_ERROR) is never consumed, so every
+// read after the end sees it again. The record is copied out, as its slot
+// may be reused as soon as the head has moved past it.
+static void tokfeed_next (struct tokfeed_t *feed, struct tokspan_t *dst)
+{
+   struct tokring_t *ring = feed->ring;
+   unsigned spins = 0;
+   while (feed->head == feed->tail) {
+      atomic_store_explicit (&ring->head, feed->head, memory_order_release);
+      feed->tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+      if (feed->head == feed->tail) {
+         tokring_wait (&spins);
+      }
+   }
+
+   *dst = ring->spans[feed->head & (TOKRING_SIZE - 1)];
+   *feed->index = dst->start + dst->len;
+   if (dst->type == token_ERROR) {
+      feed->abandoned = true;
+   } else if (dst->type != token_EOF && ++feed->head % TOKRING_BATCH == 0) {
+      atomic_store_explicit (&ring->head, feed->head, memory_order_release);
+   }
+}
+
+static int tokfeed_read (struct tokfeed_t *feed, struct token_t **dst, enum rstate_t *state)
+{
+   if (!feed->ring)
+      return token_read (dst, state, feed->input, feed->input_len, feed->index);
+
+   struct tokspan_t span;
+   tokfeed_next (feed, &span);
+   if (span.type == token_EOF)
+      return reader_EOF;
+   if (span.type == token_ERROR || span.type == token_RAW)
+      return reader_ERROR;
+   if (!(*dst = token_new (span.type, &feed->input[span.start], span.len)))
+      return reader_ERROR;
+   return reader_TOKEN;
+}
+
+// Finds the body of a verbatim literal, just after the ".raw".
+static bool tokfeed_raw (struct tokfeed_t *feed, size_t *body_start, size_t *body_len)
+{
+   if (!feed->ring)
+      return raw_find (feed->input, feed->input_len, feed->index, body_start, body_len);
+
+   struct tokspan_t span;
+   tokfeed_next (feed, &span);
+   *body_start = span.start;
+   *body_len = span.len;
+   return span.type == token_RAW;
+}
+
+// Skips the whitespace after a tagname, but not newlines.
+static void tokfeed_skip_space (struct tokfeed_t *feed)
+{
+   if (feed->ring)
+      return;
+
+   int c;
+   while ((c = getnextchar (feed->input, feed->input_len, feed->index))!=EOF) {
+      if ((c == '\n') || !(isspace (c))) {
+         (*feed->index)--;
+         break;
+      }
+   }
+}
+
+/* ********************************************************
+ * Incremental conversion, for --watch. The last input of each
+ * file is kept together with the output of each fragment of
+ * it (a run of top-level forms, at least INCR_MIN_FRAGMENT
+ * bytes long). When the file changes, only the part between
+ * the unchanged head and the unchanged tail is scanned again,
+ * and only the fragments in that part whose bytes are not
+ * already cached are parsed and emitted.
+ *
+ * A document that is a single top-level form, like (html ...),
+ * is a single fragment and so is always converted in full.
+ */
+#define INCR_MIN_FRAGMENT     (4 * 1024)
+
+struct fragment_t {
+   size_t start;
+   size_t end;
+   uint64_t hash;
+   char *output;
+   size_t output_len;
+   char *imports;
+   char *extract;
+};
+
+struct fcache_t {
+   char *ipath;
+   char *input;
+   size_t input_len;
+   struct fragment_t *frags;
+   size_t nfrags;
+};
+
+static struct fcache_t *fcaches = NULL;
+static size_t nfcaches = 0;
+
+static uint64_t content_hash (const char *input, size_t len)
+{
+   uint64_t ret = 14695981039346656037u;
+   for (size_t i=0; i<len; i++) {
+      ret = (ret ^ (uint8_t)input[i]) * 1099511628211u;
+   }
+   return ret;
+}
+
+static void fragments_del (struct fragment_t *frags, size_t nfrags)
+{
+   for (size_t i=0; i<nfrags; i++) {
+      free (frags[i].output);
+      free (frags[i].imports);
+      free (frags[i].extract);
+   }
+   free (frags);
+}
+
+static void fcache_clear (struct fcache_t *cache)
+{
+   fragments_del (cache->frags, cache->nfrags);
+   free (cache->input);
+   cache->frags = NULL;
+   cache->nfrags = 0;
+   cache->input = NULL;
+   cache->input_len = 0;
+}
+
+static void fcaches_del (void)
+{
+   for (size_t i=0; i<nfcaches; i++) {
+      fcache_clear (&fcaches[i]);
+      free (fcaches[i].ipath);
+   }
+   free (fcaches);
+   fcaches = NULL;
+   nfcaches = 0;
+}
+
+// Returns the cache for ipath, which is empty if the file has not been
+// converted before.
+static struct fcache_t *fcache_find (const char *ipath)
+{
+   for (size_t i=0; i<nfcaches; i++) {
+      if ((strcmp (fcaches[i].ipath, ipath)) == 0)
+         return &fcaches[i];
+   }
+
+   struct fcache_t *tmp = realloc (fcaches, (nfcaches + 1) * (sizeof *tmp));
+   if (!tmp) {
+      fprintf (stderr, "%s: OOM error allocating conversion cache\n", ipath);
+      return NULL;
+   }
+   fcaches = tmp;
+
+   memset (&fcaches[nfcaches], 0, sizeof fcaches[nfcaches]);
+   if (!(fcaches[nfcaches].ipath = strdup (ipath))) {
+      fprintf (stderr, "%s: OOM error allocating conversion cache\n", ipath);
+      return NULL;
+   }
+   return &fcaches[nfcaches++];
+}
+
+static size_t common_prefix (const char *lhs, const char *rhs, size_t len)
+{
+   size_t ret = 0;
+   while (ret + 4096 <= len && (memcmp (&lhs[ret], &rhs[ret], 4096)) == 0)
+      ret += 4096;
+   while (ret < len && lhs[ret] == rhs[ret])
+      ret++;
+   return ret;
+}
+
+static size_t common_suffix (const char *lhs, size_t lhs_len,
+                             const char *rhs, size_t rhs_len, size_t len)
+{
+   size_t ret = 0;
+   while (ret + 4096 <= len
+            && (memcmp (&lhs[lhs_len - ret - 4096], &rhs[rhs_len - ret - 4096], 4096)) == 0)
+      ret += 4096;
+   while (ret < len && lhs[lhs_len - ret - 1] == rhs[rhs_len - ret - 1])
+      ret++;
+   return ret;
+}
+
+// Returns 1 if the document could not be split into fragments (the caller
+// must convert it, and will report the errors), 0 on success and -1 on
+// error. On success *imports and *extract are as for split_convert().
+static int incr_convert (const char *input, size_t input_len, const char *ipath,
+                         bool want_imports, FILE *outf, char **imports, char **extract)
+{
+   struct fcache_t *cache = fcache_find (ipath);
+   size_t *bounds = NULL;
+   size_t nbounds = 0;
+   size_t *old_ends = NULL;
+   struct fragment_t *frags = NULL;
+   size_t nfrags = 0;
+   pthread_t *threads = NULL;
+   FILE *importsf = NULL;
+   size_t imports_len = 0;
+   FILE *extractf = NULL;
+   size_t extract_len = 0;
+   size_t first = 0, last = 0;
+   size_t start = 0;
+   size_t nscanned = 0;
+   int ret = -1;
+
+   struct split_t split = {
+      .input = input,
+      .ipath = ipath,
+      .want_imports = want_imports,
+      .want_extract = extract != NULL,
+      .lock = PTHREAD_MUTEX_INITIALIZER,
+      .cond = PTHREAD_COND_INITIALIZER,
+   };
+
+   if (!cache)
+      return -1;
+
+   // The fragments before first are unchanged, as are those from last
+   // onwards once they are moved by the change in length.
+   struct split_sync_t sync = { input_len, input_len - cache->input_len, NULL, 0 };
+
+   if (cache->input) {
+      size_t len = input_len < cache->input_len ? input_len : cache->input_len;
+      size_t prefix = common_prefix (input, cache->input, len);
+      size_t suffix = common_suffix (input, input_len, cache->input, cache->input_len,
+                                     len - prefix);
+      while (first < cache->nfrags && cache->frags[first].end <= prefix)
+         first++;
+      start = first ? cache->frags[first - 1].end : 0;
+
+      // The end of the last fragment is the end of the document, which
+      // is never a boundary.
+      if (!(old_ends = malloc ((cache->nfrags + 1) * (sizeof *old_ends)))) {
+         fprintf (stderr, "%s: OOM error allocating fragments\n", ipath);
+         goto cleanup;
+      }
+      for (size_t i=0; i + 1<cache->nfrags; i++) {
+         old_ends[i] = cache->frags[i].end;
+      }
+      sync.from = input_len - suffix;
+      sync.bounds = old_ends;
+      sync.nbounds = cache->nfrags ? cache->nfrags - 1 : 0;
+   }
+
+   if (start < input_len
+         && !(split_scan (&bounds, &nbounds, input, input_len,
+                          start, INCR_MIN_FRAGMENT, &sync))) {
+      ret = 1;
+      goto cleanup;
+   }
+
+   // If the scan caught up with the old boundaries, the rest of the old
+   // fragments are still good.
+   size_t scan_end = input_len;
+   if (nbounds && split_synced (&sync, bounds[nbounds - 1])) {
+      scan_end = bounds[--nbounds];
+      for (last=first; cache->frags[last].start != scan_end - sync.delta; last++)
+         ;
+   } else {
+      last = cache->nfrags;
+   }
+
+   nscanned = start < scan_end ? nbounds + 1 : 0;
+   nfrags = first + nscanned + (cache->nfrags - last);
+   if (!(frags = calloc (nfrags + 1, sizeof *frags))
+         || !(split.segments = calloc (nscanned + 1, sizeof *split.segments))
+         || !(threads = calloc (njobs, sizeof *threads))) {
+      fprintf (stderr, "%s: OOM error allocating fragments\n", ipath);
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<first; i++) {
+      frags[i] = cache->frags[i];
+   }
+   for (size_t i=0; i<cache->nfrags - last; i++) {
+      frags[first + nscanned + i] = cache->frags[last + i];
+      frags[first + nscanned + i].start += sync.delta;
+      frags[first + nscanned + i].end += sync.delta;
+   }
+
+   // The fragments that were scanned again may still have been seen
+   // before, if they were moved, so they are only converted if they
+   // cannot be found among the old fragments that they replace.
+   for (size_t i=0; i<nscanned; i++) {
+      struct fragment_t *frag = &frags[first + i];
+      frag->start = i ? bounds[i - 1] : start;
+      frag->end = i < nbounds ? bounds[i] : scan_end;
+      frag->hash = content_hash (&input[frag->start], frag->end - frag->start);
+
+      for (size_t j=first; j<last; j++) {
+         struct fragment_t *old = &cache->frags[j];
+         if (old->output && old->hash == frag->hash
+               && old->end - old->start == frag->end - frag->start
+               && (old->start == 0) == (frag->start == 0)
+               && (memcmp (&cache->input[old->start], &input[frag->start],
+                           frag->end - frag->start)) == 0) {
+            frag->output = old->output;
+            frag->output_len = old->output_len;
+            frag->imports = old->imports;
+            frag->extract = old->extract;
+            old->output = NULL;
+            old->imports = NULL;
+            old->extract = NULL;
+            break;
+         }
+      }
+
+      if (!frag->output) {
+         struct segment_t *seg = &split.segments[split.nsegments++];
+         seg->start = frag->start;
+         seg->end = frag->end;
+         seg->state = frag->start ? rstate_CONTENT : rstate_ERROR;
+      }
+   }
+
+   FPRINTF (stderr, "%s: converting %zu of %zu fragments\n", ipath, split.nsegments, nfrags);
+
+   size_t nthreads = split_start (&split, threads);
+   for (size_t i=0; i<nthreads; i++) {
+      pthread_join (threads[i], NULL);
+   }
+   if (split.failed) {
+      for (size_t i=0; i<split.nsegments; i++) {
+         free (split.segments[i].output);
+         free (split.segments[i].imports);
+         free (split.segments[i].extract);
+      }
+      fprintf (stderr, "%s: Failed to parse input, aborting\n", ipath);
+      goto cleanup;
+   }
+
+   for (size_t i=0, seg=0; i<nscanned; i++) {
+      struct fragment_t *frag = &frags[first + i];
+      if (!frag->output) {
+         frag->output = split.segments[seg].output;
+         frag->output_len = split.segments[seg].output_len;
+         frag->imports = split.segments[seg].imports;
+         frag->extract = split.segments[seg].extract;
+         seg++;
+      }
+   }
+
+   if (want_imports && !(importsf = open_memstream (imports, &imports_len))) {
+      fprintf (stderr, "%s: Failed to allocate depfile buffer: %m\n", ipath);
+      goto cleanup;
+   }
+   if (extract && !(extractf = open_memstream (extract, &extract_len))) {
+      fprintf (stderr, "%s: Failed to allocate side output buffer: %m\n", ipath);
+      goto cleanup;
+   }
+   for (size_t i=0; i<nfrags; i++) {
+      fwrite (frags[i].output, 1, frags[i].output_len, outf);
+      if (importsf) {
+         fputs (frags[i].imports, importsf);
+      }
+      if (extractf) {
+         fputs (frags[i].extract, extractf);
+      }
+   }
+
+   char *tmp = malloc (input_len + 1);
+   if (!tmp) {
+      fprintf (stderr, "%s: OOM error caching input\n", ipath);
+      goto cleanup;
+   }
+   memcpy (tmp, input, input_len + 1);
+
+   // The unchanged fragments now belong to the new list
+   for (size_t i=0; i<cache->nfrags; i++) {
+      if (i < first || i >= last) {
+         cache->frags[i].output = NULL;
+         cache->frags[i].imports = NULL;
+         cache->frags[i].extract = NULL;
+      }
+   }
+   fcache_clear (cache);
+   cache->input = tmp;
+   cache->input_len = input_len;
+   cache->frags = frags;
+   cache->nfrags = nfrags;
+   frags = NULL;
+
+   ret = 0;
+cleanup:
+   if (importsf && (fclose (importsf)) != 0) {
+      ret = -1;
+   }
+   if (extractf && (fclose (extractf)) != 0) {
+      ret = -1;
+   }
+   // A document that could not be scanned leaves the cache as it was, so
+   // the next change is compared with the last input that converted.
+   if (ret < 0) {
+      // Only the fragments that were scanned are owned by the new list;
+      // the rest are still in the cache, which is dropped so that the
+      // next conversion starts from scratch.
+      for (size_t i=0; frags && i<nscanned; i++) {
+         free (frags[first + i].output);
+         free (frags[first + i].imports);
+         free (frags[first + i].extract);
+      }
+      fcache_clear (cache);
+   }
+   free (frags);
+   free (threads);
+   free (split.segments);
+   free (old_ends);
+   free (bounds);
+   return ret;
+}
+
+/* ********************************************************
+ * Tar archives (ustar, with pax and GNU long names). Input
+ * members are converted as they are read, and output members
+ * are written as each file is converted, so a whole site can
+ * be streamed from one pipe to another.
+ */
+#define TAR_BLOCK       (512)
+
+struct tar_header_t {
+   char name[100];
+   char mode[8];
+   char uid[8];
+   char gid[8];
+   char size[12];
+   char mtime[12];
+   char chksum[8];
+   char typeflag;
+   char linkname[100];
+   char magic[6];
+   char version[2];
+   char uname[32];
+   char gname[32];
+   char devmajor[8];
+   char devminor[8];
+   char prefix[155];
+   char pad[12];
+};
+
+static unsigned tar_checksum (const struct tar_header_t *header)
+{
+   const unsigned char *bytes = (const unsigned char *)header;
+   unsigned ret = 0;
+   for (size_t i=0; i<sizeof *header; i++) {
+      bool in_chksum = i >= offsetof (struct tar_header_t, chksum)
+                     && i < offsetof (struct tar_header_t, chksum) + sizeof header->chksum;
+      ret += in_chksum ? ' ' : bytes[i];
+   }
+   return ret;
+}
+
+// Strips the leading "/" and "./" from path, as tar does
+static const char *tar_path (const char *path)
+{
+   while (path[0] == '/' || (path[0] == '.' && path[1] == '/')) {
+      path += path[0] == '/' ? 1 : 2;
+   }
+   return path;
+}
+
+// Member names must stay below the current directory when written out
+static bool tar_path_safe (const char *path)
+{
+   for (const char *p=path; *p; ) {
+      size_t len = strcspn (p, "/");
+      if (len == 2 && p[0] == '.' && p[1] == '.')
+         return false;
+      p += len;
+      p += *p == '/';
+   }
+   return path[0] != 0;
+}
+
+// Finds where a name too long for the ustar name field can be split
+// between the prefix and name fields. Returns false if it cannot be.
+static bool tar_split_name (const char *name, size_t name_len, size_t *prefix_len)
+{
+   const size_t max_name = sizeof ((struct tar_header_t *)0)->name;
+   const size_t max_prefix = sizeof ((struct tar_header_t *)0)->prefix;
+
+   *prefix_len = 0;
+   if (name_len <= max_name)
+      return true;
+
+   for (size_t i=name_len - max_name - 1; i<name_len && i<=max_prefix; i++) {
+      if (name[i] == '/') {
+         *prefix_len = i;
+         return i > 0;
+      }
+   }
+   return false;
+}
+
+// The name must fit, with the help of tar_split_name() if necessary
+static bool tar_write_header (FILE *outf, const char *name, size_t name_len,
+                              char typeflag, size_t size, time_t mtime)
+{
+   struct tar_header_t header;
+   size_t prefix_len;
+
+   memset (&header, 0, sizeof header);
+   tar_split_name (name, name_len, &prefix_len);
+   if (prefix_len) {
+      memcpy (header.prefix, name, prefix_len);
+      name += prefix_len + 1;
+      name_len -= prefix_len + 1;
+   }
+   memcpy (header.name, name, name_len);
+
+   snprintf (header.mode, sizeof header.mode, "%07o", 0644);
+   snprintf (header.uid, sizeof header.uid, "%07o", 0);
+   snprintf (header.gid, sizeof header.gid, "%07o", 0);
+   snprintf (header.size, sizeof header.size, "%011llo", (unsigned long long)size);
+   snprintf (header.mtime, sizeof header.mtime, "%011llo", (unsigned long long)mtime);
+   header.typeflag = typeflag;
+   memcpy (header.magic, "ustar", 6);
+   memcpy (header.version, "00", 2);
+   snprintf (header.chksum, sizeof header.chksum, "%06o", tar_checksum (&header));
+   header.chksum[7] = ' ';
+
+   return (fwrite (&header, sizeof header, 1, outf)) == 1;
+}
+
+static bool tar_write_data (FILE *outf, const char *data, size_t data_len)
+{
+   static const char zeros[TAR_BLOCK];
+   size_t padding = (TAR_BLOCK - data_len % TAR_BLOCK) % TAR_BLOCK;
+   return (fwrite (data, 1, data_len, outf)) == data_len
+       && (fwrite (zeros, 1, padding, outf)) == padding;
+}
+
+// Writes the output for the input file ipath as a member of the tar
+// output, named for ipath without the trailing ".lisp". Names that do
+// not fit into a ustar header are preceded by a pax header.
+static bool tar_write_member (FILE *outf, const char *ipath,
+                              const char *data, size_t data_len, time_t mtime)
+{
+   const char *name = tar_path (ipath);
+   size_t name_len = strlen (name) - strlen (".lisp");
+   size_t prefix_len;
+   bool ok;
+
+   if (!(tar_path_safe (name))) {
+      fprintf (stderr, "%s: Refusing to write tar member outside the current directory\n", ipath);
+      return false;
+   }
+
+   if (tar_split_name (name, name_len, &prefix_len)) {
+      ok = tar_write_header (outf, name, name_len, '0', data_len, mtime);
+   } else {
+      // The length at the start of a pax record includes its own digits
+      char record[PATH_MAX + 32];
+      size_t base_len = strlen (" path=\n") + name_len, record_len = 0;
+      for (size_t ndigits=1; record_len == 0; ndigits++) {
+         int len = snprintf (NULL, 0, "%zu", base_len + ndigits);
+         record_len = (size_t)len == ndigits ? base_len + ndigits : 0;
+      }
+      ok = record_len < sizeof record
+         && snprintf (record, sizeof record, "%zu path=%.*s\n",
+                      record_len, (int)name_len, name) == (int)record_len
+         && tar_write_header (outf, "PaxHeader", 9, 'x', record_len, mtime)
+         && tar_write_data (outf, record, record_len)
+         && tar_write_header (outf, name, sizeof ((struct tar_header_t *)0)->name,
+                              '0', data_len, mtime);
+   }
+
+   if (!ok || !(tar_write_data (outf, data, data_len))) {
+      fprintf (stderr, "%s: Failed to write tar member: %m\n", ipath);
+      return false;
+   }
+   return true;
+}
+
+static bool tar_write_end (FILE *outf)
+{
+   static const char zeros[TAR_BLOCK * 2];
+   return (fwrite (zeros, 1, sizeof zeros, outf)) == sizeof zeros;
+}
+
+// Converts the input, writing the HTML to outf. The import dependencies
+// are returned in *imports, unless imports is NULL, and likewise the side
+// output records in *extract. The ipath is used in messages and to
+// resolve relative imports.
+static int convert (char *input, size_t input_len, const char *ipath,
+                    FILE *outf, char **imports, char **extract)
+{
+   struct node_t *root = NULL;
+   struct tagtab_t tags = { NULL, 0, 0 };
+   int ret = EXIT_FAILURE;
+
+   // The reader stops at the first NUL byte, if there is one
+   if (!input_len || !(input_len = strlen (input))) {
+      fprintf (stderr, "%s: No input provided. See the documentation for help\n", ipath);
+      goto cleanup;
+   }
+
+   size_t invalid = utf8_invalid_offset (input, input_len);
+   if (invalid < input_len) {
+      fprintf (stderr, "%s: Invalid UTF-8 at byte offset %zu\n", ipath, invalid);
+      goto cleanup;
+   }
+
+   int rc = flag_watch
+          ? incr_convert (input, input_len, ipath, imports != NULL, outf, imports, extract)
+          : split_convert (input, input_len, ipath, imports != NULL, outf, imports, extract);
+   if (rc < 0) {
+      goto cleanup;
+   }
+   if (rc > 0) {
+      size_t index = 0;
+      rc = parse (&root, &tags, input, input_len,  &index);
+      if (rc < 0) {
+         fprintf (stderr, "%s: Failed to parse input, aborting\n", ipath);
+         goto cleanup;
+      }
+      if (rc > 0) {
+         fprintf (stderr, "%s: Unparsed input still in buffer\n", ipath);
+         goto cleanup;
+      }
+
+      for (size_t i=0; i<root->nchildren; i++) {
+         node_emit_html(root->children[i], 0, outf);
+      }
+
+      if (imports && !(*imports = depfile_imports (ipath, root))) {
+         goto cleanup;
+      }
+      if (extract && !(*extract = extract_records (ipath, root))) {
+         goto cleanup;
+      }
+   }
+
+   FPRINTF (stderr, "%s: complete\n", ipath);
+   ret = EXIT_SUCCESS;
+
+cleanup:
+   node_del (root);
+   tagtab_del (&tags);
+   return ret;
+}
+
+// Converts the input of the file at ipath, writing the HTML to the
+// file ofname relative to dirfd, or to the tar output if there is one.
+// The opath is the path of the output as the user would see it.
+static int convert_output (int dirfd, const char *ofname, const char *opath,
+                           const char *ipath, char *input, size_t input_len, time_t mtime)
+{
+   int ret = EXIT_FAILURE;
+   FILE *outf = NULL;
+   char *output = NULL;
+   size_t output_len = 0;
+   char *imports = NULL;
+   char *extract = NULL;
+   bool want_imports = flag_depfiles || depfile_outf;
+   bool want_extract = flag_text || flag_manifest || index_outf;
+
+   if (tar_outf) {
+      if (!(outf = open_memstream (&output, &output_len))) {
+         fprintf (stderr, "%s: Failed to allocate output buffer: %m\n", ipath);
+         goto cleanup;
+      }
+   } else {
+      if (!(outf = fopenat (dirfd, ofname, "w"))) {
+         fprintf (stderr, "%s: opened\n", ofname);
+         fprintf (stderr, "%s: Failed to open [%s] for writing: %m\n", ipath, ofname);
+         goto cleanup;
+      }
+   }
+
+   int rc = convert (input, input_len, ipath, outf, want_imports ? &imports : NULL,
+                     want_extract ? &extract : NULL);
+
+   if ((fclose (outf)) != 0) {
+      fprintf (stderr, "%s: Failed to write [%s]: %m\n", ipath, ofname);
+      goto cleanup;
+   }
+   if (rc != EXIT_SUCCESS) {
+      goto cleanup;
+   }
+
+   if (tar_outf && !(tar_write_member (tar_outf, ipath, output, output_len, mtime))) {
+      goto cleanup;
+   }
+
+   if (want_imports && !(write_depfiles (dirfd, ofname, opath, ipath, imports))) {
+      goto cleanup;
+   }
+
+   if (want_extract && !(write_side_outputs (dirfd, ofname, opath, ipath, extract))) {
+      goto cleanup;
+   }
+
+   ret = EXIT_SUCCESS;
+cleanup:
+   free (output);
+   free (imports);
+   free (extract);
+   return ret;
+}
+
+/* ********************************************************
+ * Output directories for -o. The layout of the input is
+ * mirrored below the output directory; each directory there
+ * is created and opened when the first file is written to it,
+ * and stays open until its input directory has been done.
+ */
+struct outdir_t {
+   struct outdir_t *parent;   // NULL if the path is created from scratch
+   const char *name;          // The name within parent
+   char *path;                // The path as the user would see it
+   int fd;
+};
+
+static bool mkdir_parents (const char *path)
+{
+   char *tmp = strdup (path);
+   bool ret = tmp != NULL;
+
+   for (char *p=tmp ? strchr (tmp, '/') : NULL; ret && p; p=strchr (p + 1, '/')) {
+      *p = 0;
+      if (tmp[0] && (mkdir (tmp, 0777)) != 0 && errno != EEXIST) {
+         fprintf (stderr, "Failed to create directory [%s]: %m\n", tmp);
+         ret = false;
+      }
+      *p = '/';
+   }
+
+   free (tmp);
+   return ret;
+}
+
+static bool outdir_root (struct outdir_t *out, const char *path)
+{
+   memset (out, 0, sizeof *out);
+   out->fd = -1;
+   if (!(out->path = strdup (path))) {
+      fprintf (stderr, "OOM error allocating output directory [%s]\n", path);
+      return false;
+   }
+   return true;
+}
+
+static bool outdir_child (struct outdir_t *out, struct outdir_t *parent, const char *name)
+{
+   size_t path_len = strlen (parent->path) + strlen (name) + 2;
+
+   memset (out, 0, sizeof *out);
+   out->fd = -1;
+   out->parent = parent;
+   out->name = name;
+   if (!(out->path = malloc (path_len))) {
+      fprintf (stderr, "OOM error allocating output directory [%s/%s]\n", parent->path, name);
+      return false;
+   }
+   snprintf (out->path, path_len, "%s/%s", parent->path, name);
+   return true;
+}
+
+// The output directory for the input directory or file at ipath, which
+// may not go above the current directory.
+static bool outdir_for_path (struct outdir_t *out, const char *ipath, bool is_dir)
+{
+   const char *rpath = tar_path (ipath);
+   const char *slash = strrchr (rpath, '/');
+   size_t rdir_len = is_dir ? strlen (rpath) : slash ? (size_t)(slash - rpath) : 0;
+
+   if (!(tar_path_safe (rpath))) {
+      fprintf (stderr, "%s: Cannot mirror a path outside the current directory\n", ipath);
+      return false;
+   }
+
+   size_t path_len = strlen (outdir) + rdir_len + 2;
+   char *path = malloc (path_len);
+   if (!path) {
+      fprintf (stderr, "OOM error allocating output directory for [%s]\n", ipath);
+      return false;
+   }
+   snprintf (path, path_len, "%s%s%.*s", outdir, rdir_len ? "/" : "", (int)rdir_len, rpath);
+
+   memset (out, 0, sizeof *out);
+   out->fd = -1;
+   out->path = path;
+   return true;
+}
+
+static void outdir_close (struct outdir_t *out)
+{
+   if (out->fd >= 0) {
+      close (out->fd);
+   }
+   free (out->path);
+   out->path = NULL;
+   out->fd = -1;
+}
+
+// Returns the descriptor of the output directory, creating it if need be.
+static int outdir_open (struct outdir_t *out)
+{
+   if (out->fd >= 0)
+      return out->fd;
+
+   int parentfd = AT_FDCWD;
+   const char *name = out->path;
+   if (out->parent) {
+      if ((parentfd = outdir_open (out->parent)) < 0)
+         return -1;
+      name = out->name;
+   } else {
+      size_t path_len = strlen (out->path);
+      char *tmp = malloc (path_len + 2);
+      if (!tmp) {
+         fprintf (stderr, "OOM error creating output directory [%s]\n", out->path);
+         return -1;
+      }
+      snprintf (tmp, path_len + 2, "%s/", out->path);
+      bool ok = mkdir_parents (tmp);
+      free (tmp);
+      if (!ok)
+         return -1;
+   }
+
+   if (out->parent && (mkdirat (parentfd, name, 0777)) != 0 && errno != EEXIST) {
+      fprintf (stderr, "Failed to create directory [%s]: %m\n", out->path);
+      return -1;
+   }
+
+   if ((out->fd = openat (parentfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+      fprintf (stderr, "Failed to open output directory [%s]: %m\n", out->path);
+   }
+   return out->fd;
+}
+
+/* ********************************************************
+ * Duplicate inputs. The hash and length of every input that
+ * was converted is remembered, and when another input turns
+ * out to be byte-for-byte the same, the output of the first
+ * one is copied (or hardlinked, with --link-duplicates)
+ * instead of converting it again.
+ *
+ * Relative imports depend on where the input is, so nothing
+ * is deduplicated when depfiles are being written, nor when
+ * there are side outputs, which name the page.
+ */
+struct seen_t {
+   uint64_t hash;
+   size_t input_len;
+   char *ipath;
+   char *opath;
+};
+
+struct seentab_t {
+   struct seen_t *slots;
+   size_t nslots;
+   size_t nseen;
+};
+
+static struct seentab_t seen = { NULL, 0, 0 };
+
+static bool dedup_enabled (void)
+{
+   return !tar_outf && !flag_watch && !flag_depfiles && !depfile_outf
+       && !flag_text && !flag_manifest && !index_outf;
+}
+
+static void seentab_del (struct seentab_t *tab)
+{
+   for (size_t i=0; i<tab->nslots; i++) {
+      free (tab->slots[i].ipath);
+      free (tab->slots[i].opath);
+   }
+   free (tab->slots);
+   memset (tab, 0, sizeof *tab);
+}
+
+// Returns the slot holding the first input with this hash and length,
+// or the empty slot where it should go.
+static struct seen_t *seentab_slot (const struct seentab_t *tab, uint64_t hash, size_t input_len)
+{
+   size_t mask = tab->nslots - 1;
+   for (size_t i=hash & mask; ; i=(i + 1) & mask) {
+      struct seen_t *entry = &tab->slots[i];
+      if (!entry->ipath || (entry->hash == hash && entry->input_len == input_len)) {
+         return entry;
+      }
+   }
+}
+
+static bool seentab_grow (struct seentab_t *tab)
+{
+   struct seentab_t newtab = { NULL, tab->nslots ? tab->nslots * 2 : 256, tab->nseen };
+   if (!(newtab.slots = calloc (newtab.nslots, sizeof *newtab.slots))) {
+      fprintf (stderr, "OOM error growing duplicate table\n");
+      return false;
+   }
+
+   for (size_t i=0; i<tab->nslots; i++) {
+      if (tab->slots[i].ipath) {
+         *seentab_slot (&newtab, tab->slots[i].hash, tab->slots[i].input_len) = tab->slots[i];
+      }
+   }
+
+   free (tab->slots);
+   *tab = newtab;
+   return true;
+}
+
+static void seentab_add (struct seentab_t *tab, uint64_t hash, size_t input_len,
+                         const char *ipath, const char *opath)
+{
+   if ((tab->nseen + 1) * 2 > tab->nslots && !(seentab_grow (tab)))
+      return;
+
+   struct seen_t *entry = seentab_slot (tab, hash, input_len);
+   if (entry->ipath)
+      return;
+
+   if (!(entry->ipath = strdup (ipath)) || !(entry->opath = strdup (opath))) {
+      free (entry->ipath);
+      entry->ipath = NULL;
+      return;
+   }
+   entry->hash = hash;
+   entry->input_len = input_len;
+   tab->nseen++;
+}
+
+// Hash collisions are possible, so the earlier input is read back and
+// compared before its output is used.
+static bool file_equals (const char *fname, const char *input, size_t input_len)
+{
+   char buf[64 * 1024];
+   size_t nread = 0, n;
+   bool ret = true;
+   FILE *inf = fopen (fname, "r");
+
+   if (!inf)
+      return false;
+
+   while (ret && (n = fread (buf, 1, sizeof buf, inf)) > 0) {
+      ret = nread + n <= input_len && (memcmp (buf, &input[nread], n)) == 0;
+      nread += n;
+   }
+
+   ret = ret && !ferror (inf) && nread == input_len;
+   fclose (inf);
+   return ret;
+}
+
+// Makes ofname, relative to dirfd, a copy of the file src. The copy is
+// a reflink where the filesystem supports it, and is done in the kernel
+// where it can be.
+static bool output_copy (const char *src, int dirfd, const char *ofname)
+{
+   int infd = -1, outfd = -1;
+   bool ret = false;
+   struct stat sb;
+
+   // An earlier --link-duplicates may have left ofname linked to src
+   if ((unlinkat (dirfd, ofname, 0)) != 0 && errno != ENOENT)
+      return false;
+
+   if (flag_link_duplicates && (linkat (AT_FDCWD, src, dirfd, ofname, 0)) == 0)
+      return true;
+
+   if ((infd = open (src, O_RDONLY | O_CLOEXEC)) < 0 || (fstat (infd, &sb)) != 0)
+      goto cleanup;
+   if ((outfd = openat (dirfd, ofname, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) < 0)
+      goto cleanup;
+
+   if ((ioctl (outfd, FICLONE, infd)) == 0) {
+      ret = true;
+      goto cleanup;
+   }
+
+   off_t remaining = sb.st_size;
+   while (remaining > 0) {
+      ssize_t n = copy_file_range (infd, NULL, outfd, NULL, remaining, 0);
+      if (n <= 0)
+         break;
+      remaining -= n;
+   }
+
+   // Not every filesystem, or pair of filesystems, can copy in the kernel
+   if (remaining > 0) {
+      char buf[64 * 1024];
+      ssize_t n;
+      if ((lseek (infd, sb.st_size - remaining, SEEK_SET)) < 0)
+         goto cleanup;
+      while ((n = read (infd, buf, sizeof buf)) > 0) {
+         if ((write (outfd, buf, n)) != n)
+            goto cleanup;
+         remaining -= n;
+      }
+   }
+
+   ret = remaining == 0;
+cleanup:
+   if (infd >= 0) {
+      close (infd);
+   }
+   if (outfd >= 0 && (close (outfd)) != 0) {
+      ret = false;
+   }
+   return ret;
+}
+
+// Returns 1 if the input has not been seen before (the caller must convert
+// it, and then add it to seen), 0 if the output was copied from an earlier
+// identical input and -1 on error.
+static int dedup_output (int dirfd, const char *ofname, const char *ipath,
+                         uint64_t hash, const char *input, size_t input_len)
+{
+   if (!seen.nslots)
+      return 1;
+
+   const struct seen_t *entry = seentab_slot (&seen, hash, input_len);
+   if (!entry->ipath || !(file_equals (entry->ipath, input, input_len)))
+      return 1;
+
+   if (!(output_copy (entry->opath, dirfd, ofname))) {
+      fprintf (stderr, "%s: Failed to copy [%s] to [%s]: %m\n", ipath, entry->opath, ofname);
+      return -1;
+   }
+
+   FPRINTF (stderr, "%s: same as [%s]\n", ipath, entry->ipath);
+   return 0;
+}
+
+// The file ifname is opened relative to dirfd; ipath is the path of the
+// same file as the user would see it, and is what goes into depfiles.
+// The output is written next to the input, or into out if it is not
+// NULL.
+static int process_file (int dirfd, const char *ifname, const char *ipath,
+                         struct outdir_t *out)
+{
+   char *input = NULL;
+   size_t input_len = 0;
+
+   int ret = EXIT_FAILURE;
+   FILE *inf = NULL;
+   char *ofname = NULL;
+   char *opath = NULL;
+   int odirfd = dirfd;
+   struct stat sb;
+
+   if (!ifname) {
+      fprintf (stderr, "%s: NULL passed for input filename\n", ifname);
+      goto cleanup;
+   }
+
+   // Input from stdin always goes to stdout, and its side outputs only
+   // to the index
+   if ((strcmp (ifname, "-")) == 0) {
+      char *extract = NULL;
+      if (!(read_all (&input, &input_len, stdin))) {
+         fprintf (stderr, "%s: Failed to read input: %m\n", ifname);
+         goto cleanup;
+      }
+      ret = convert (input, input_len, ifname, stdout, NULL, index_outf ? &extract : NULL);
+      if (ret == EXIT_SUCCESS && index_outf
+            && !(write_side_outputs (AT_FDCWD, NULL, ifname, ifname, extract))) {
+         ret = EXIT_FAILURE;
+      }
+      free (extract);
+      goto cleanup;
+   }
+
+   // The output filename is the input filename with the trailing ".lisp"
+   // removed.
+   if (!(fext_match (ifname))) {
+      fprintf (stderr, "%s: Input filename missing [%s]\n", ifname, fext);
+      goto cleanup;
+   }
+
+   // In an output directory, only the last component of ifname is used
+   const char *base = ifname;
+   if (out && strrchr (ifname, '/')) {
+      base = strrchr (ifname, '/') + 1;
+   }
+
+   if (!(ofname = strndup (base, strlen (base) - strlen (".lisp")))) {
+      fprintf (stderr, "%s: OOM error allocating output filename\n", ifname);
+      goto cleanup;
+   }
+
+   if (out) {
+      size_t opath_len = strlen (out->path) + strlen (ofname) + 2;
+      if ((opath = malloc (opath_len))) {
+         snprintf (opath, opath_len, "%s/%s", out->path, ofname);
+      }
+   } else {
+      opath = strndup (ipath, strlen (ipath) - strlen (".lisp"));
+   }
+   if (!opath) {
+      fprintf (stderr, "%s: OOM error allocating output path\n", ifname);
+      goto cleanup;
+   }
+
+   if (!(inf = fopenat (dirfd, ifname, "r"))) {
+      fprintf (stderr, "%s: opened\n", ifname);
+      fprintf (stderr, "%s: Failed to open [%s] for reading: %m\n", ifname, ifname);
+      goto cleanup;
+   }
+
+   if (!(read_all (&input, &input_len, inf))) {
+      fprintf (stderr, "%s: Failed to read input: %m\n", ifname);
+      goto cleanup;
+   }
+
+   time_t mtime = (fstat (fileno (inf), &sb)) == 0 ? sb.st_mtime : time (NULL);
+   fclose (inf);
+   inf = NULL;
+
+   if (out && (odirfd = outdir_open (out)) < 0) {
+      goto cleanup;
+   }
+
+   uint64_t hash = 0;
+   if (dedup_enabled ()) {
+      hash = content_hash (input, input_len);
+      int rc = dedup_output (odirfd, ofname, ipath, hash, input, input_len);
+      if (rc <= 0) {
+         ret = rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+         goto cleanup;
+      }
+   }
+
+   ret = convert_output (odirfd, ofname, opath, ipath, input, input_len, mtime);
+
+   if (ret == EXIT_SUCCESS && dedup_enabled ()) {
+      seentab_add (&seen, hash, input_len, ipath, opath);
+   }
+
+cleanup:
+   if (inf) {
+      fclose (inf);
+   }
+
+   free (opath);
+   free (ofname);
+   free (input);
+   return ret;
+}
+
+/* ********************************************************
+ * Tar input. Every regular member named '*.html.lisp' is
+ * converted; all other members are skipped.
+ */
+
+// Numeric header fields are octal or, if the top bit of the first byte
+// is set, base-256.
+static bool tar_number (const char *field, size_t field_len, unsigned long long *dst)
+{
+   *dst = 0;
+   if ((unsigned char)field[0] & 0x80) {
+      for (size_t i=0; i<field_len; i++) {
+         unsigned char c = i ? field[i] : field[i] & 0x7f;
+         *dst = (*dst << 8) | c;
+      }
+      return true;
+   }
+
+   size_t i = 0;
+   while (i < field_len && field[i] == ' ')
+      i++;
+   for (; i < field_len && field[i] >= '0' && field[i] <= '7'; i++) {
+      *dst = (*dst << 3) | (field[i] - '0');
+   }
+   return i == field_len || field[i] == 0 || field[i] == ' ';
+}
+
+// Returns the value of the "path" record in the pax header, if any
+static char *tar_pax_path (const char *data, size_t data_len)
+{
+   size_t i = 0;
+   while (i < data_len) {
+      char *end = NULL;
+      unsigned long len = strtoul (&data[i], &end, 10);
+      if (!len || len > data_len - i || *end != ' ')
+         return NULL;
+      const char *key = end + 1;
+      const char *record_end = &data[i + len - 1];
+      if ((size_t)(record_end - key) > 5 && (memcmp (key, "path=", 5)) == 0) {
+         return strndup (key + 5, record_end - key - 5);
+      }
+      i += len;
+   }
+   return NULL;
+}
+
+static int process_tar_member (const char *name, char *data, size_t data_len, time_t mtime)
+{
+   const char *ipath = tar_path (name);
+   char *opath = NULL;
+   int ret = EXIT_FAILURE;
+
+   if (!(tar_path_safe (ipath))) {
+      fprintf (stderr, "%s: Refusing to convert tar member outside the current directory\n", name);
+      return EXIT_FAILURE;
+   }
+
+   size_t opath_len = (outdir ? strlen (outdir) + 1 : 0) + strlen (ipath) + 1;
+   if (!(opath = malloc (opath_len))) {
+      fprintf (stderr, "%s: OOM error allocating output filename\n", ipath);
+      goto cleanup;
+   }
+   snprintf (opath, opath_len, "%s%s%s", outdir ? outdir : "", outdir ? "/" : "", ipath);
+   opath[strlen (opath) - strlen (".lisp")] = 0;
+
+   if (!tar_outf && !(mkdir_parents (opath))) {
+      goto cleanup;
+   }
+
+   ret = convert_output (AT_FDCWD, tar_outf ? NULL : opath, opath, ipath, data, data_len, mtime);
+
+cleanup:
+   free (opath);
+   return ret;
+}
+
+static int process_tar (const char *fname)
+{
+   struct tar_header_t header;
+   char *data = NULL;
+   size_t data_alloced = 0;
+   char *longname = NULL;
+   int errcount = 1;
+
+   FILE *inf = (strcmp (fname, "-")) == 0 ? stdin : fopen (fname, "r");
+   if (!inf) {
+      fprintf (stderr, "Failed to open tar input [%s] for reading: %m\n", fname);
+      return errcount;
+   }
+
+   errcount = 0;
+   while ((fread (&header, sizeof header, 1, inf)) == 1) {
+      unsigned long long size, mtime, chksum;
+      bool is_zero = true;
+      for (size_t i=0; is_zero && i<sizeof header; i++) {
+         is_zero = ((const char *)&header)[i] == 0;
+      }
+      if (is_zero)
+         break;
+
+      if (!(tar_number (header.chksum, sizeof header.chksum, &chksum))
+            || chksum != tar_checksum (&header)
+            || !(tar_number (header.size, sizeof header.size, &size))
+            || !(tar_number (header.mtime, sizeof header.mtime, &mtime))) {
+         fprintf (stderr, "%s: Corrupt tar header\n", fname);
+         errcount++;
+         break;
+      }
+
+      size_t padded = size + (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+      if (padded + 1 > data_alloced) {
+         char *tmp = realloc (data, padded + 1);
+         if (!tmp) {
+            fprintf (stderr, "%s: OOM error reading tar member of %llu bytes\n", fname, size);
+            errcount++;
+            break;
+         }
+         data = tmp;
+         data_alloced = padded + 1;
+      }
+      if ((fread (data, 1, padded, inf)) != padded) {
+         fprintf (stderr, "%s: Truncated tar input\n", fname);
+         errcount++;
+         break;
+      }
+      data[size] = 0;
+
+      // Long names come from the header before the member they name
+      if (header.typeflag == 'x' || header.typeflag == 'L') {
+         free (longname);
+         longname = header.typeflag == 'x' ? tar_pax_path (data, size) : strndup (data, size);
+         continue;
+      }
+
+      char name[sizeof header.prefix + sizeof header.name + 2];
+      snprintf (name, sizeof name, "%.*s%s%.*s",
+                (int)strnlen (header.prefix, sizeof header.prefix), header.prefix,
+                header.prefix[0] ? "/" : "",
+                (int)strnlen (header.name, sizeof header.name), header.name);
+      const char *mname = longname ? longname : name;
+
+      if ((header.typeflag == '0' || header.typeflag == 0) && fext_match (mname)) {
+         errcount += process_tar_member (mname, data, size, mtime) == EXIT_SUCCESS ? 0 : 1;
+      } else {
+         FPRINTF (stderr, "%s: Skipping tar member [%s]\n", fname, mname);
+      }
+
+      free (longname);
+      longname = NULL;
+   }
+
+   if (ferror (inf)) {
+      fprintf (stderr, "%s: Failed to read tar input: %m\n", fname);
+      errcount++;
+   }
+
+   if (inf != stdin) {
+      fclose (inf);
+   }
+   free (longname);
+   free (data);
+   return errcount;
+}
+
+/* ********************************************************
+ * Directory traversal. Each directory is opened relative to
+ * its parent's descriptor so that the process never changes
+ * its working directory, and the entries are read in a single
+ * pass before any of them are processed.
+ */
+struct dentry_t {
+   char *name;
+   ino_t ino;
+   unsigned char type;
+};
+
+static int dentry_cmp_ino (const void *lhs, const void *rhs)
+{
+   const struct dentry_t *l = lhs, *r = rhs;
+   return l->ino < r->ino ? -1 : l->ino > r->ino ? 1 : 0;
+}
+
+static void dentries_del (struct dentry_t *dentries, size_t ndentries)
+{
+   for (size_t i=0; i<ndentries; i++) {
+      free (dentries[i].name);
+   }
+   free (dentries);
+}
+
+// Reads all the entries of the (already open) directory, skipping
+// dot-files. Returns false on error.
+static bool dentries_read (struct dentry_t **dst, size_t *dst_len, DIR *dirp)
+{
+   struct dirent *de = NULL;
+   size_t nalloced = 0;
+
+   errno = 0;
+   while ((de = readdir (dirp)) != NULL) {
+      if (de->d_name[0] == '.') {
+         continue;
+      }
+      if (*dst_len >= nalloced) {
+         size_t newlen = nalloced ? nalloced * 2 : 64;
+         struct dentry_t *tmp = realloc (*dst, newlen * (sizeof *tmp));
+         if (!tmp) {
+            return false;
+         }
+         *dst = tmp;
+         nalloced = newlen;
+      }
+      struct dentry_t *dentry = &(*dst)[*dst_len];
+      if (!(dentry->name = strdup (de->d_name))) {
+         return false;
+      }
+      dentry->ino = de->d_ino;
+      dentry->type = de->d_type;
+      (*dst_len)++;
+      errno = 0;
+   }
+
+   return errno == 0;
+}
+
+// Only called when the filesystem does not fill in d_type
+static unsigned char dentry_stat_type (int dirfd, const char *name)
+{
+   struct stat sb;
+   if ((fstatat (dirfd, name, &sb, AT_SYMLINK_NOFOLLOW)) != 0) {
+      return DT_UNKNOWN;
+   }
+   if (S_ISDIR (sb.st_mode))
+      return DT_DIR;
+   if (S_ISREG (sb.st_mode))
+      return DT_REG;
+   if (S_ISLNK (sb.st_mode))
+      return DT_LNK;
+   return DT_UNKNOWN;
+}
+
+// The directory dname is opened relative to parentfd; dpath is only used
+// for messages and is the path of the directory as the user would see it.
+static int process_dir (int parentfd, const char *dname, const char *dpath, bool recurse,
+                        struct outdir_t *out)
+{
+   int errcount = 1;
+   int dirfd = -1;
+   DIR *dirp = NULL;
+   struct dentry_t *dentries = NULL;
+   size_t ndentries = 0;
+
+   if ((dirfd = openat (parentfd, dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+      fprintf (stderr, "Failed to open directory [%s]: %m\n", dpath);
+      goto cleanup;
    }
 
-   FPRINTF (stderr, "Changed to directory [%s]\n", ifname);
+   if (!(dirp = fdopendir (dirfd))) {
+      fprintf (stderr, "Failed to open directory [%s] for reading: %m\n", dpath);
+      close (dirfd);
+      goto cleanup;
+   }
 
-   if (!pwd) {
-      fprintf (stderr, "Failed to switch to directory [%s]: %m\n", ifname);
+   FPRINTF (stderr, "Entered directory [%s]\n", dpath);
+
+   if (flag_watch && !(watch_add (dpath, NULL, recurse, out ? out->path : NULL))) {
       goto cleanup;
    }
 
-   if (!(dirp = opendir ("."))) {
-      fprintf (stderr, "Failed to directory [%s] for reading: %m\n", ifname);
+   if (!(dentries_read (&dentries, &ndentries, dirp))) {
+      fprintf (stderr, "Failed to read directory [%s]: %m\n", dpath);
       goto cleanup;
    }
 
+   // Visiting entries in inode order keeps the disk head moving in
+   // one direction on a cold cache.
+   if (flag_inode_order) {
+      qsort (dentries, ndentries, sizeof *dentries, dentry_cmp_ino);
+   }
+
    errcount = 0;
-   errno = 0;
 
-   while ((de = readdir (dirp)) != NULL) {
-      if (errno) {
-         fprintf (stderr, "Failed to read directory [%s]: %m\n", ifname);
+   for (size_t i=0; i<ndentries; i++) {
+      const char *name = dentries[i].name;
+      unsigned char type = dentries[i].type;
+
+      if (type == DT_UNKNOWN) {
+         type = dentry_stat_type (dirfd, name);
+      }
+
+      bool is_input = type != DT_DIR && fext_match (name);
+      if (!(recurse && type == DT_DIR) && !is_input) {
+         continue;
+      }
+
+      size_t cpath_len = strlen (dpath) + strlen (name) + 2;
+      char *cpath = malloc (cpath_len);
+      if (!cpath) {
+         fprintf (stderr, "OOM error allocating path for [%s/%s]\n", dpath, name);
          errcount++;
-         goto cleanup;
+         continue;
       }
-      if (de->d_name[0] == '.') {
+      snprintf (cpath, cpath_len, "%s/%s", dpath, name);
+
+      if (is_input) {
+         errcount += process_file (dirfd, name, cpath, out) == 0 ? 0 : 1;
+      } else if (!out) {
+         errcount += process_dir (dirfd, name, cpath, recurse, NULL) == 0 ? 0 : 1;
+      } else {
+         struct outdir_t child;
+         if (outdir_child (&child, out, name)) {
+            errcount += process_dir (dirfd, name, cpath, recurse, &child) == 0 ? 0 : 1;
+         } else {
+            errcount++;
+         }
+         outdir_close (&child);
+      }
+      free (cpath);
+   }
+
+cleanup:
+   if (dirp) {
+      FPRINTF (stderr, "Left directory [%s]\n", dpath);
+      closedir (dirp);
+   }
+
+   dentries_del (dentries, ndentries);
+   return errcount;
+}
+
+/* ********************************************************
+ * Watch mode. Every directory that was processed is watched
+ * for files being written or moved into it, as is the
+ * directory of each file named on the command-line. Files are
+ * converted again as they change, using the cached fragments
+ * of the previous conversion.
+ */
+struct watch_t {
+   int wd;
+   char *dpath;
+   char *ipath;      // NULL to convert every input file in dpath
+   char *odir;       // The -o directory for dpath, or NULL
+   bool recurse;
+};
+
+static int watch_fd = -1;
+static struct watch_t *watches = NULL;
+static size_t nwatches = 0;
+
+// The ipath is the path of a single file in dpath to be watched, or NULL
+// to watch all the input files in dpath. The odir is where the outputs
+// for dpath go, or NULL to write them next to the inputs.
+static bool watch_add (const char *dpath, const char *ipath, bool recurse, const char *odir)
+{
+   uint32_t mask = IN_MASK_ADD | IN_CLOSE_WRITE | IN_MOVED_TO | (recurse ? IN_CREATE : 0);
+   int wd = inotify_add_watch (watch_fd, dpath, mask);
+   if (wd < 0) {
+      fprintf (stderr, "Failed to watch [%s]: %m\n", dpath);
+      return false;
+   }
+
+   for (size_t i=0; i<nwatches; i++) {
+      if (watches[i].wd == wd && !watches[i].ipath && !ipath)
+         return true;
+   }
+
+   struct watch_t *tmp = realloc (watches, (nwatches + 1) * (sizeof *tmp));
+   if (!tmp) {
+      fprintf (stderr, "OOM error allocating watch for [%s]\n", dpath);
+      return false;
+   }
+   watches = tmp;
+
+   struct watch_t *watch = &watches[nwatches];
+   watch->wd = wd;
+   watch->recurse = recurse;
+   watch->dpath = strdup (dpath);
+   watch->ipath = ipath ? strdup (ipath) : NULL;
+   watch->odir = odir ? strdup (odir) : NULL;
+   if (!watch->dpath || (ipath && !watch->ipath) || (odir && !watch->odir)) {
+      fprintf (stderr, "OOM error allocating watch for [%s]\n", dpath);
+      free (watch->dpath);
+      free (watch->ipath);
+      free (watch->odir);
+      return false;
+   }
+   nwatches++;
+   return true;
+}
+
+static bool watch_add_file (const char *ipath, const char *odir)
+{
+   const char *slash = strrchr (ipath, '/');
+   if (!slash)
+      return watch_add (".", ipath, false, odir);
+
+   char *dpath = strndup (ipath, slash == ipath ? 1 : slash - ipath);
+   if (!dpath) {
+      fprintf (stderr, "OOM error allocating watch for [%s]\n", ipath);
+      return false;
+   }
+   bool ret = watch_add (dpath, ipath, false, odir);
+   free (dpath);
+   return ret;
+}
+
+static void watches_del (void)
+{
+   for (size_t i=0; i<nwatches; i++) {
+      free (watches[i].dpath);
+      free (watches[i].ipath);
+      free (watches[i].odir);
+   }
+   free (watches);
+   watches = NULL;
+   nwatches = 0;
+   if (watch_fd >= 0) {
+      close (watch_fd);
+      watch_fd = -1;
+   }
+}
+
+static void watch_event (const struct inotify_event *event)
+{
+   // Watches may be added while this runs, which moves the array
+   for (size_t i=0; i<nwatches; i++) {
+      if (watches[i].wd != event->wd)
+         continue;
+
+      // Copied, as the outdir must outlive any move of the array
+      struct outdir_t out = { .fd = -1 };
+      if (watches[i].odir && !(outdir_root (&out, watches[i].odir)))
+         continue;
+
+      const char *ipath = watches[i].ipath;
+      if (ipath) {
+         const char *slash = strrchr (ipath, '/');
+         if ((strcmp (slash ? slash + 1 : ipath, event->name)) == 0) {
+            process_file (AT_FDCWD, ipath, ipath, out.path ? &out : NULL);
+         }
+         outdir_close (&out);
+         continue;
+      }
+
+      bool is_dir = event->mask & IN_ISDIR;
+      if ((is_dir ? !watches[i].recurse : !(fext_match (event->name)))
+            || (!is_dir && (event->mask & IN_CREATE))) {
+         outdir_close (&out);
          continue;
       }
-      if (recurse && de->d_type == DT_DIR) {
-         errcount += process_dir (de->d_name, recurse) == 0 ? 0 : 1;
+
+      size_t cpath_len = strlen (watches[i].dpath) + strlen (event->name) + 2;
+      char *cpath = malloc (cpath_len);
+      if (!cpath) {
+         fprintf (stderr, "OOM error allocating path for [%s/%s]\n",
+                  watches[i].dpath, event->name);
+         outdir_close (&out);
          continue;
       }
-      // TODO: Still handling file-checking wrong. This will have some
-      // false positives. Check the other TODO about why this is broken
-      if ((strstr (de->d_name, ".html.lisp")) != NULL) {
-         errcount += process_file(de->d_name) == 0 ? 0 : 1;
+      snprintf (cpath, cpath_len, "%s/%s", watches[i].dpath, event->name);
+
+      if (!out.path) {
+         if (is_dir) {
+            process_dir (AT_FDCWD, cpath, cpath, true, NULL);
+         } else {
+            process_file (AT_FDCWD, cpath, cpath, NULL);
+         }
+      } else if (is_dir) {
+         struct outdir_t child;
+         if (outdir_child (&child, &out, event->name)) {
+            process_dir (AT_FDCWD, cpath, cpath, true, &child);
+         }
+         outdir_close (&child);
+      } else {
+         process_file (AT_FDCWD, cpath, cpath, &out);
       }
-      errno = 0;
+      outdir_close (&out);
+      free (cpath);
    }
+}
+
+// Only returns if the events cannot be read.
+static int watch_run (void)
+{
+   static char buf[64 * 1024] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
 
+   FPRINTF (stderr, "Watching %zu directories for changes\n", nwatches);
 
-cleanup:
-   if ((chdir (pwd)) != 0) {
-      fprintf (stderr, "Failed to return to previous directory: %m\n");
+   while (1) {
+      ssize_t nbytes = read (watch_fd, buf, sizeof buf);
+      if (nbytes < 0 && errno == EINTR)
+         continue;
+      if (nbytes <= 0) {
+         fprintf (stderr, "Failed to read file events: %m\n");
+         return 1;
+      }
+
+      for (ssize_t i=0; i<nbytes; ) {
+         const struct inotify_event *event = (const struct inotify_event *)&buf[i];
+         if (event->len) {
+            watch_event (event);
+         }
+         i += sizeof *event + event->len;
+      }
+
+      if (depfile_outf) {
+         fflush (depfile_outf);
+      }
+      if (index_outf) {
+         fflush (index_outf);
+      }
    }
+}
 
-   FPRINTF (stderr, "Left directory [%s]\n", ifname);
+/* ********************************************************
+ * Worklists from "--files-from". Entries are separated by NUL
+ * bytes if the list contains any, otherwise by newlines, so
+ * that the output of both `find -print0` and `git diff
+ * --name-only` can be used directly.
+ */
+// The entries point into *list, which the caller must free after
+// the paths have been processed.
+static bool files_from_read (char ***paths, size_t *npaths, char **list, const char *fname)
+{
+   size_t list_len = 0;
+   bool ret = false;
+   FILE *inf = (strcmp (fname, "-")) == 0 ? stdin : fopen (fname, "r");
 
-   free (pwd);
-   if (dirp) {
-      closedir (dirp);
+   if (!inf) {
+      fprintf (stderr, "Failed to open [%s] for reading: %m\n", fname);
+      return false;
    }
-   return errcount;
+
+   if (!(read_all (list, &list_len, inf))) {
+      fprintf (stderr, "Failed to read [%s]: %m\n", fname);
+      goto cleanup;
+   }
+
+   char sep = list_len && memchr (*list, 0, list_len) ? 0 : '\n';
+   for (size_t i=0; i<list_len; i++) {
+      char *entry = &(*list)[i];
+      char *end = memchr (entry, sep, list_len - i);
+      if (!end) {
+         end = &(*list)[list_len];
+      }
+      *end = 0;
+      i += end - entry;
+      if (sep == '\n' && end > entry && end[-1] == '\r') {
+         end[-1] = 0;
+      }
+      if (!entry[0]) {
+         continue;
+      }
+
+      char **tmp = realloc (*paths, (*npaths + 2) * (sizeof (*tmp)));
+      if (!tmp) {
+         fprintf (stderr, "OOM error allocating paths (%zu encountered)\n", *npaths);
+         goto cleanup;
+      }
+      tmp[(*npaths)++] = entry;
+      tmp[*npaths] = NULL;
+      *paths = tmp;
+   }
+
+   ret = true;
+cleanup:
+   if (inf != stdin) {
+      fclose (inf);
+   }
+   return ret;
 }
 
 static void print_help_msg (void)
@@ -723,7 +4062,34 @@ static void print_help_msg (void)
 "error message without any processing of files or data.",
 "",
 "-r | --recurse     Recursively process any directories specified",
+"-I | --inode-order Process directory entries in inode order (faster on cold disks)",
 "-s | --stdio       Read input from stdin and write the output to stdout",
+"--files-from FILE  Also process each path listed in FILE (NUL or newline",
+"                   separated). Use '-' to read the list from stdin",
+"-j | --jobs N      Use N threads to convert large files (default: one per CPU)",
+"--pipeline         Lex large files that are not split between threads in a",
+"                   thread of their own, while they are parsed",
+"--tar-in FILE      Convert the '*.html.lisp' members of the tar archive FILE",
+"                   ('-' for stdin), writing the results to the filesystem",
+"-o DIR             Write the results below DIR instead of next to the inputs,",
+"                   mirroring the paths of the inputs",
+"--tar-out FILE     Write all results as members of the tar archive FILE",
+"                   ('-' for stdout) instead of to the filesystem; inputs",
+"                   outside the current directory are refused",
+"-MD                Write a depfile '*.html.d' next to each output file",
+"-MF FILE           Write the depfile rules for all outputs to FILE",
+"--text             Write the plain text of each page to '*.html.txt' next to",
+"                   each output file",
+"--manifest         Write the title, headings and links (href and src) of each",
+"                   page as JSON to '*.html.json' next to each output file",
+"--index FILE       Write the manifest and text of every page to FILE ('-' for",
+"                   stdout), one JSON object per line",
+"--link-duplicates  Hardlink the outputs of identical inputs to each other",
+"                   instead of copying them",
+"-w | --watch       After converting, keep watching the paths and convert each",
+"                   file again when it changes, re-parsing only the top-level",
+"                   forms that changed",
+"-E | --no-escape   Write content and attribute values without HTML escaping",
 "-v | --verbose     Produce extra informational messages",
 "-V | --version     Print the program version, then continue as normal",
 "-h | --help        Display this message and exit",
@@ -746,6 +4112,12 @@ int main (int argc, char **argv)
    char **paths = NULL;
    size_t npaths = 0;
    size_t errcount = 0;
+   const char *files_from = NULL;
+   char *files_list = NULL;
+   const char *depfile_name = NULL;
+   const char *index_name = NULL;
+   const char *tar_in = NULL;
+   const char *tar_out = NULL;
 
    (void)argc;
 
@@ -755,6 +4127,14 @@ int main (int argc, char **argv)
             flag_recurse = true;
             continue;
          }
+         if ((strcmp (argv[i], "-I"))==0 || (strcmp (argv[i], "--inode-order"))==0) {
+            flag_inode_order = true;
+            continue;
+         }
+         if ((strcmp (argv[i], "-E"))==0 || (strcmp (argv[i], "--no-escape"))==0) {
+            flag_escape = false;
+            continue;
+         }
          if ((strcmp (argv[i], "-v"))==0 || (strcmp (argv[i], "--verbose"))==0) {
             flag_verbose = true;
             continue;
@@ -771,6 +4151,57 @@ int main (int argc, char **argv)
             flag_stdio = true;
             continue;
          }
+         if ((strcmp (argv[i], "--link-duplicates"))==0) {
+            flag_link_duplicates = true;
+            continue;
+         }
+         if ((strcmp (argv[i], "--pipeline"))==0) {
+            flag_pipeline = true;
+            continue;
+         }
+         if ((strcmp (argv[i], "--text"))==0) {
+            flag_text = true;
+            continue;
+         }
+         if ((strcmp (argv[i], "--manifest"))==0) {
+            flag_manifest = true;
+            continue;
+         }
+         if ((strcmp (argv[i], "-w"))==0 || (strcmp (argv[i], "--watch"))==0) {
+            flag_watch = true;
+            continue;
+         }
+         if ((strcmp (argv[i], "-MD"))==0) {
+            flag_depfiles = true;
+            continue;
+         }
+         if ((strcmp (argv[i], "-j"))==0 || (strcmp (argv[i], "--jobs"))==0) {
+            char *end = NULL;
+            njobs = argv[i+1] ? strtoul (argv[i+1], &end, 10) : 0;
+            if (!end || *end || !njobs) {
+               fprintf (stderr, "Flag [%s] requires a thread count\n", argv[i]);
+               errcount++;
+            }
+            i += argv[i+1] ? 1 : 0;
+            continue;
+         }
+         if ((strcmp (argv[i], "--files-from"))==0 || (strcmp (argv[i], "-MF"))==0
+               || (strcmp (argv[i], "--tar-in"))==0 || (strcmp (argv[i], "--tar-out"))==0
+               || (strcmp (argv[i], "-o"))==0 || (strcmp (argv[i], "--index"))==0) {
+            if (!argv[i+1]) {
+               fprintf (stderr, "Flag [%s] requires a filename\n", argv[i]);
+               errcount++;
+               continue;
+            }
+            const char **dst = argv[i][1] == 'M'            ? &depfile_name
+                             : (strcmp (argv[i], "--tar-in"))==0  ? &tar_in
+                             : (strcmp (argv[i], "--tar-out"))==0 ? &tar_out
+                             : (strcmp (argv[i], "-o"))==0        ? &outdir
+                             : (strcmp (argv[i], "--index"))==0   ? &index_name
+                             : &files_from;
+            *dst = argv[++i];
+            continue;
+         }
          fprintf (stderr, "Unrecognised flag [%s]. Try --help\n", argv[i]);
          errcount++;
       } else {
@@ -800,11 +4231,73 @@ int main (int argc, char **argv)
    }
 
 
-   if (!paths && !flag_stdio && !flag_recurse) {
+   if (!njobs) {
+      long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+      njobs = ncpus > 0 ? ncpus : 1;
+   }
+
+   // Checked before the list is read, as reading it takes all of stdin
+   bool list_from_stdin = files_from && (strcmp (files_from, "-")) == 0;
+   if (list_from_stdin && (flag_stdio || (tar_in && (strcmp (tar_in, "-")) == 0))) {
+      fprintf (stderr, "Cannot read both --files-from and %s from stdin\n",
+               flag_stdio ? "--stdio" : "--tar-in");
+      errcount++;
+   } else if (files_from && !(files_from_read (&paths, &npaths, &files_list, files_from))) {
+      errcount++;
+   }
+
+   if (depfile_name && (strcmp (depfile_name, "-")) == 0) {
+      depfile_outf = stdout;
+   }
+
+   if (depfile_name && !depfile_outf && !(depfile_outf = fopen (depfile_name, "w"))) {
+      fprintf (stderr, "Failed to open depfile [%s] for writing: %m\n", depfile_name);
+      errcount++;
+   }
+
+   if (index_name && (strcmp (index_name, "-")) == 0) {
+      index_outf = stdout;
+   }
+
+   if (index_name && !index_outf && !(index_outf = fopen (index_name, "w"))) {
+      fprintf (stderr, "Failed to open index [%s] for writing: %m\n", index_name);
+      errcount++;
+   }
+
+   if (tar_out && (strcmp (tar_out, "-")) == 0) {
+      tar_outf = stdout;
+   }
+
+   if (tar_out && !tar_outf && !(tar_outf = fopen (tar_out, "w"))) {
+      fprintf (stderr, "Failed to open tar output [%s] for writing: %m\n", tar_out);
+      errcount++;
+   }
+
+   if (!paths && !flag_stdio && !flag_recurse && !files_from && !tar_in) {
       fprintf (stderr, "No pathnames specified, aborting\n");
       errcount++;
    }
 
+   if (outdir && (flag_stdio || tar_out)) {
+      fprintf (stderr, "Cannot write to an output directory with --stdio or --tar-out\n");
+      errcount++;
+   }
+
+   if (tar_in && flag_stdio) {
+      fprintf (stderr, "Cannot read both --tar-in and --stdio\n");
+      errcount++;
+   }
+
+   if (flag_watch && (flag_stdio || tar_in || tar_out)) {
+      fprintf (stderr, "Cannot watch for changes with --stdio, --tar-in or --tar-out\n");
+      errcount++;
+   }
+
+   if (flag_watch && !errcount && (watch_fd = inotify_init1 (IN_CLOEXEC)) < 0) {
+      fprintf (stderr, "Failed to start watching for changes: %m\n");
+      errcount++;
+   }
+
    if (errcount) {
       fprintf (stderr, "Errors in invocation (%zu), aborting\n", errcount);
       goto cleanup;
@@ -812,69 +4305,117 @@ int main (int argc, char **argv)
 
    errcount = 0;
 
-   for (size_t i=0; !flag_stdio && paths[i]; i++) {
+   for (size_t i=0; !flag_stdio && paths && paths[i]; i++) {
       struct stat sb;
       if ((stat (paths[i], &sb)) != 0) {
          fprintf (stderr, "Failed to stat [%s]: %m\n", paths[i]);
          errcount++;
          continue;
       }
+      struct outdir_t out = { .fd = -1 };
+      if (outdir && !(outdir_for_path (&out, paths[i], S_ISDIR (sb.st_mode)))) {
+         errcount++;
+         continue;
+      }
       if (S_ISDIR (sb.st_mode)) {
-         if ((process_dir (paths[i], flag_recurse)) != EXIT_SUCCESS) {
+         if ((process_dir (AT_FDCWD, paths[i], paths[i], flag_recurse,
+                           outdir ? &out : NULL)) != EXIT_SUCCESS) {
             fprintf (stderr, "Error processing directory [%s]: %m\n", paths[i]);
             errcount++;
-            continue;
          }
       } else {
-         if ((process_file (paths[i])) != EXIT_SUCCESS) {
+         if (flag_watch && !(watch_add_file (paths[i], out.path))) {
+            errcount++;
+         }
+         if ((process_file (AT_FDCWD, paths[i], paths[i], outdir ? &out : NULL)) != EXIT_SUCCESS) {
             fprintf (stderr, "Error processing [%s]\n", paths[i]);
             errcount++;
-            continue;
          }
       }
+      outdir_close (&out);
+   }
+
+   // Errors so far are reported, but the files can still be fixed
+   if (flag_watch) {
+      if (depfile_outf) {
+         fflush (depfile_outf);
+      }
+      if (index_outf) {
+         fflush (index_outf);
+      }
+      errcount += watch_run ();
+   }
+
+   if (tar_in) {
+      errcount += process_tar (tar_in);
    }
 
    if (flag_stdio) {
-      errcount += process_file("-") == EXIT_SUCCESS ? 0 : 1;
+      errcount += process_file(AT_FDCWD, "-", "-", NULL) == EXIT_SUCCESS ? 0 : 1;
+   }
+
+   if (tar_outf && !(tar_write_end (tar_outf))) {
+      fprintf (stderr, "Failed to write tar output: %m\n");
+      errcount++;
    }
 
    ret = errcount;
 
 cleanup:
+   if (depfile_outf && depfile_outf != stdout) {
+      fclose (depfile_outf);
+   }
+   if (index_outf && (index_outf == stdout ? fflush (index_outf) : fclose (index_outf)) != 0) {
+      fprintf (stderr, "Failed to write index [%s]: %m\n", index_name);
+      ret = ret ? ret : EXIT_FAILURE;
+   }
+   if (tar_outf && (tar_outf == stdout ? fflush (tar_outf) : fclose (tar_outf)) != 0) {
+      fprintf (stderr, "Failed to write tar output: %m\n");
+      ret = ret ? ret : EXIT_FAILURE;
+   }
+   watches_del ();
+   fcaches_del ();
+   seentab_del (&seen);
+   free (files_list);
    free (paths);
    FPRINTF (stderr, "Exit-code: %i\n", ret);
    return ret;
 }
 
-static bool builtin_valid (const char *symbol)
+
+static bool parse_raw (struct node_t *parent, struct tokfeed_t *feed)
 {
-   static const char *builtins[] = {
-      ".",
-      ".import",
-   };
-   static const size_t builtins_len = sizeof builtins / sizeof builtins[0];
+   size_t body_start, body_len;
+   char error_context[81];
 
-   for (size_t i=0; i<builtins_len; i++) {
-      if ((strcmp (symbol, builtins[i]))==0) {
-         return true;
+   if (!(tokfeed_raw (feed, &body_start, &body_len))) {
+      if (!feed->abandoned) {
+         snprintf (error_context, sizeof error_context, "%s", &feed->input[*feed->index]);
+         fprintf (stderr, "Unterminated (.raw ...) near:\n%s\n", error_context);
       }
+      return false;
    }
 
-   return false;
+   struct node_t *node = node_new (parent, node_RAW, NULL);
+   if (!node || !(node->value = strndup (&feed->input[body_start], body_len))) {
+      fprintf (stderr, "OOM error constructing raw node\n");
+      return false;
+   }
+   return true;
 }
 
-// returns 0 for EOF, -1 for error and 1 for success
-static int parser (struct node_t *parent,
-                   const char *input, size_t input_len, size_t *index)
+// returns 0 for EOF, -1 for error and 1 for success. The reader state
+// is only anything other than rstate_ERROR when resuming at the top-level
+// of a document.
+static int parser (struct node_t *parent, enum rstate_t state, struct tagtab_t *tags,
+                   struct tokfeed_t *feed)
 {
    struct token_t *tok;
    enum reader_action_t rc;
-   static char error_context[81];
-   // Starting off in the error state does not trigger special behaviour
-   enum rstate_t state = rstate_ERROR;
+   char error_context[81];
 
    while (1) {
-      rc = token_read (&tok, &state, input, input_len, index);
+      rc = tokfeed_read (feed, &tok, &state);
       if (rc == reader_CONTINUE) {
          continue;
       }
@@ -885,7 +4426,8 @@ static int parser (struct node_t *parent,
       switch (tok->type) {
          case token_OPEN_PAREN:
             token_del (tok);
-            rc = token_read (&tok, &state, input, input_len, index);
+            tok = NULL;
+            rc = tokfeed_read (feed, &tok, &state);
             if (rc == reader_CONTINUE) {
                continue;
             }
@@ -896,22 +4438,32 @@ static int parser (struct node_t *parent,
             // Ensure that we reserve all symbols beginning with a '.' (period)
             // because if we don't and users start using custom tagnames beginning
             // with a period, at some point in the future the input will break.
-            if (tok->text[0] == '.' && !(builtin_valid (tok->text))) {
+            if (tok->text[0] == '.' && !(tag_class (tok->text) == tag_BUILTIN)) {
                fprintf (stderr, "Unrecognised builtin: [%s]\n", tok->text);
                token_del (tok);
                return -1;
             }
 
+            if ((strcmp (tok->text, ".raw")) == 0) {
+               if (!(parse_raw (parent, feed))) {
+                  token_del (tok);
+                  return -1;
+               }
+               state = rstate_CONTENT;
+               break;
+            }
+
             struct node_t *root = NULL;
             if ((memcmp (&tok->text[0], ".", 2)) == 0) {
                root = parent;
-               if (!(node_new (parent, node_SYMBOL, "("))) {
+               if (!(node_add_text (parent, "(", 1, false))) {
                   fprintf (stderr, "Failed to create symbol node: [(]\n");
                   token_del (tok);
                   return -1;
                }
             } else {
-               root = node_new (parent, node_LIST, tok->text);
+               const struct tag_t *tag = tag_intern (tags, tok->text);
+               root = tag ? node_new_list (parent, tag) : NULL;
                if (!root) {
                   fprintf (stderr, "OOM error constructing root node\n");
                   token_del (tok);
@@ -927,19 +4479,14 @@ static int parser (struct node_t *parent,
             // we should respect that in the output, but any spaces after
             // a tagname needs to be removed as the user doesn't want the
             // input "A(tag B)C" to be turned into "A <tag> B </tag> C".
-            int c;
-            while ((c = getnextchar (input, input_len, index))!=EOF) {
-               if ((c == '\n') || !(isspace (c))) {
-                  (*index)--;
-                  break;
-               }
-            }
+            tokfeed_skip_space (feed);
 
-            rc = parser (root, input, input_len, index);
+            // Starting off in the error state does not trigger special behaviour
+            rc = parser (root, rstate_ERROR, tags, feed);
 
             if ((memcmp (&tok->text[0], ".", 2)) == 0) {
                root = parent;
-               if (!(node_new (parent, node_SYMBOL, ")"))) {
+               if (!(node_add_text (parent, ")", 1, false))) {
                   fprintf (stderr, "Failed to create symbol node: [)]\n");
                   token_del (tok);
                   return -1;
@@ -956,7 +4503,7 @@ static int parser (struct node_t *parent,
             return 1;
 
          case token_SYMBOL:
-            if (!(node_new (parent, node_SYMBOL, tok->text))) {
+            if (!(node_add_text (parent, tok->text, strlen (tok->text), false))) {
                fprintf (stderr, "Failed to create symbol node: [%s]\n", tok->text);
                token_del (tok);
                return -1;
@@ -972,7 +4519,7 @@ static int parser (struct node_t *parent,
             break;
 
          case token_WHITESPACE:
-            if (!(node_new (parent, node_WHITESPACE, tok->text))) {
+            if (!(node_add_text (parent, " ", 1, false))) {
                fprintf (stderr, "Failed to create whitespace node\n");
                token_del (tok);
                return -1;
@@ -980,7 +4527,7 @@ static int parser (struct node_t *parent,
             break;
 
          case token_NEWLINE:
-            if (!(node_new (parent, node_NEWLINE, tok->text))) {
+            if (!(node_add_text (parent, "\n", 1, true))) {
                fprintf (stderr, "Failed to create newline node\n");
                token_del (tok);
                return -1;
@@ -997,25 +4544,55 @@ static int parser (struct node_t *parent,
 
       token_del (tok);
    }
-   if (rc < 0) {
-      snprintf (error_context, sizeof error_context - 1, "%s", &input[(*index)-1]);
+   if (rc < 0 && !feed->abandoned) {
+      snprintf (error_context, sizeof error_context - 1, "%s", &feed->input[(*feed->index)-1]);
       fprintf (stderr, "Encountered an error while parsing near:\n%s\n", error_context);
    }
 
    return rc;
 }
 
-static int parse (struct node_t **dst,
+// The tags of the tree are added to tags, which must outlive the tree.
+// With --pipeline a large input is lexed by a thread of its own, and
+// parsed again without it if that thread could not follow it.
+static int parse (struct node_t **dst, struct tagtab_t *tags,
                   const char *input, size_t input_len, size_t *index)
 {
-   struct node_t *root = node_new (NULL, node_LIST, "root");
+   struct tokfeed_t feed = { input, input_len, index, NULL, 0, 0, false };
+   size_t start = *index;
+   pthread_t lexer;
+
+   const struct tag_t *tag = tag_intern (tags, "root");
+   struct node_t *root = tag ? node_new_list (NULL, tag) : NULL;
    if (!root) {
       fprintf (stderr, "OOM error constructing root node\n");
       return -1;
    }
 
-   int rc;
-   if ((rc = parser (root, input, input_len, index)) < 0) {
+   // The lexer thread is one of the jobs, so '-j 1' keeps to one thread.
+   if (flag_pipeline && njobs > 1 && input_len - start >= PIPE_MIN_INPUT) {
+      feed.ring = tokring_start (&lexer, input, input_len, start);
+   }
+
+   int rc = parser (root, rstate_ERROR, tags, &feed);
+
+   if (feed.ring) {
+      tokring_end (feed.ring, lexer);
+      feed.ring = NULL;
+   }
+   if (feed.abandoned) {
+      FPRINTF (stderr, "Parsing again without the lexer thread\n");
+      node_del (root);
+      if (!(root = node_new_list (NULL, tag))) {
+         fprintf (stderr, "OOM error constructing root node\n");
+         return -1;
+      }
+      *index = start;
+      feed.abandoned = false;
+      rc = parser (root, rstate_ERROR, tags, &feed);
+   }
+
+   if (rc < 0) {
       fprintf (stderr, "Failed to parse\n");
    }
    if (rc == 1) {
@@ -1030,20 +4607,3 @@ static int parse (struct node_t **dst,
 
    return rc;
 }
-
-static bool collect_input (char **dst, size_t *dst_len, const char *line)
-{
-   size_t line_len = strlen (line);
-   char *tmp = realloc (*dst, *dst_len + line_len + 1);
-   if (!tmp) {
-      return false;
-   }
-
-   strcpy (&tmp[*dst_len], line);
-
-   *dst = tmp;
-   *dst_len += line_len;
-
-   return true;
-}
-
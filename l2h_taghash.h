@@ -0,0 +1,28 @@
+// vim: set ts=3 sw=3 colorcolumn=100 et
+
+// The hash of tagnames, shared by l2h_gentags.c, which looks for a seed
+// that gives every known tagname a slot of its own, and l2h_main.c, which
+// looks tagnames up in those slots. Both must hash alike, so this is the
+// only copy.
+
+#ifndef L2H_TAGHASH_H
+#define L2H_TAGHASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// FNV-1a, starting from the offset basis xor seed
+static inline uint32_t taghash (uint32_t seed, const char *name, size_t name_len)
+{
+   uint32_t hash = 2166136261u ^ seed;
+   for (size_t i=0; i<name_len; i++) {
+      hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+   }
+   return hash;
+}
+
+// Folds the high bits of a hash into the slot of a table of nslots, which
+// must be a power of two.
+#define TAGHASH_SLOT(hash, nslots)     (((hash) ^ ((hash) >> 16)) & ((nslots) - 1))
+
+#endif
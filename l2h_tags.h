@@ -0,0 +1,249 @@
+// Generated by l2h_gentags from l2h_gentags.c; do not edit.
+// 119 names, 1024 slots.
+
+#define TAGCLASS_SEED     912u
+#define TAGCLASS_NSLOTS   1024
+
+static const struct tag_t known_tags[] = {
+   { ".", 1, 0, "<.>", 3, "</.>", 4, tag_BUILTIN },
+   { ".import", 7, 0, "<.import>", 9, "</.import>", 10, tag_BUILTIN },
+   { ".raw", 4, 0, "<.raw>", 6, "</.raw>", 7, tag_BUILTIN },
+   { "!DOCTYPE", 8, 0, "<!DOCTYPE>", 10, "</!DOCTYPE>", 11, tag_VOID },
+   { "!doctype", 8, 0, "<!doctype>", 10, "</!doctype>", 11, tag_VOID },
+   { "area", 4, 0, "<area>", 6, "</area>", 7, tag_VOID },
+   { "base", 4, 0, "<base>", 6, "</base>", 7, tag_VOID },
+   { "br", 2, 0, "<br>", 4, "</br>", 5, tag_VOID },
+   { "col", 3, 0, "<col>", 5, "</col>", 6, tag_VOID },
+   { "embed", 5, 0, "<embed>", 7, "</embed>", 8, tag_VOID },
+   { "hr", 2, 0, "<hr>", 4, "</hr>", 5, tag_VOID },
+   { "img", 3, 0, "<img>", 5, "</img>", 6, tag_VOID },
+   { "input", 5, 0, "<input>", 7, "</input>", 8, tag_VOID },
+   { "link", 4, 0, "<link>", 6, "</link>", 7, tag_VOID },
+   { "meta", 4, 0, "<meta>", 6, "</meta>", 7, tag_VOID },
+   { "param", 5, 0, "<param>", 7, "</param>", 8, tag_VOID },
+   { "source", 6, 0, "<source>", 8, "</source>", 9, tag_VOID },
+   { "track", 5, 0, "<track>", 7, "</track>", 8, tag_VOID },
+   { "wbr", 3, 0, "<wbr>", 5, "</wbr>", 6, tag_VOID },
+   { "script", 6, 0, "<script>", 8, "</script>", 9, tag_RAW_TEXT },
+   { "style", 5, 0, "<style>", 7, "</style>", 8, tag_RAW_TEXT },
+   { "root", 4, 0, "<root>", 6, "</root>", 7, tag_ORDINARY },
+   { "a", 1, 0, "<a>", 3, "</a>", 4, tag_ORDINARY },
+   { "abbr", 4, 0, "<abbr>", 6, "</abbr>", 7, tag_ORDINARY },
+   { "address", 7, 0, "<address>", 9, "</address>", 10, tag_ORDINARY },
+   { "article", 7, 0, "<article>", 9, "</article>", 10, tag_ORDINARY },
+   { "aside", 5, 0, "<aside>", 7, "</aside>", 8, tag_ORDINARY },
+   { "audio", 5, 0, "<audio>", 7, "</audio>", 8, tag_ORDINARY },
+   { "b", 1, 0, "<b>", 3, "</b>", 4, tag_ORDINARY },
+   { "bdi", 3, 0, "<bdi>", 5, "</bdi>", 6, tag_ORDINARY },
+   { "bdo", 3, 0, "<bdo>", 5, "</bdo>", 6, tag_ORDINARY },
+   { "blockquote", 10, 0, "<blockquote>", 12, "</blockquote>", 13, tag_ORDINARY },
+   { "body", 4, 0, "<body>", 6, "</body>", 7, tag_ORDINARY },
+   { "button", 6, 0, "<button>", 8, "</button>", 9, tag_ORDINARY },
+   { "canvas", 6, 0, "<canvas>", 8, "</canvas>", 9, tag_ORDINARY },
+   { "caption", 7, 0, "<caption>", 9, "</caption>", 10, tag_ORDINARY },
+   { "cite", 4, 0, "<cite>", 6, "</cite>", 7, tag_ORDINARY },
+   { "code", 4, 0, "<code>", 6, "</code>", 7, tag_ORDINARY },
+   { "colgroup", 8, 0, "<colgroup>", 10, "</colgroup>", 11, tag_ORDINARY },
+   { "data", 4, 0, "<data>", 6, "</data>", 7, tag_ORDINARY },
+   { "datalist", 8, 0, "<datalist>", 10, "</datalist>", 11, tag_ORDINARY },
+   { "dd", 2, 0, "<dd>", 4, "</dd>", 5, tag_ORDINARY },
+   { "del", 3, 0, "<del>", 5, "</del>", 6, tag_ORDINARY },
+   { "details", 7, 0, "<details>", 9, "</details>", 10, tag_ORDINARY },
+   { "dfn", 3, 0, "<dfn>", 5, "</dfn>", 6, tag_ORDINARY },
+   { "dialog", 6, 0, "<dialog>", 8, "</dialog>", 9, tag_ORDINARY },
+   { "div", 3, 0, "<div>", 5, "</div>", 6, tag_ORDINARY },
+   { "dl", 2, 0, "<dl>", 4, "</dl>", 5, tag_ORDINARY },
+   { "dt", 2, 0, "<dt>", 4, "</dt>", 5, tag_ORDINARY },
+   { "em", 2, 0, "<em>", 4, "</em>", 5, tag_ORDINARY },
+   { "fieldset", 8, 0, "<fieldset>", 10, "</fieldset>", 11, tag_ORDINARY },
+   { "figcaption", 10, 0, "<figcaption>", 12, "</figcaption>", 13, tag_ORDINARY },
+   { "figure", 6, 0, "<figure>", 8, "</figure>", 9, tag_ORDINARY },
+   { "footer", 6, 0, "<footer>", 8, "</footer>", 9, tag_ORDINARY },
+   { "form", 4, 0, "<form>", 6, "</form>", 7, tag_ORDINARY },
+   { "h1", 2, 0, "<h1>", 4, "</h1>", 5, tag_ORDINARY },
+   { "h2", 2, 0, "<h2>", 4, "</h2>", 5, tag_ORDINARY },
+   { "h3", 2, 0, "<h3>", 4, "</h3>", 5, tag_ORDINARY },
+   { "h4", 2, 0, "<h4>", 4, "</h4>", 5, tag_ORDINARY },
+   { "h5", 2, 0, "<h5>", 4, "</h5>", 5, tag_ORDINARY },
+   { "h6", 2, 0, "<h6>", 4, "</h6>", 5, tag_ORDINARY },
+   { "head", 4, 0, "<head>", 6, "</head>", 7, tag_ORDINARY },
+   { "header", 6, 0, "<header>", 8, "</header>", 9, tag_ORDINARY },
+   { "hgroup", 6, 0, "<hgroup>", 8, "</hgroup>", 9, tag_ORDINARY },
+   { "html", 4, 0, "<html>", 6, "</html>", 7, tag_ORDINARY },
+   { "i", 1, 0, "<i>", 3, "</i>", 4, tag_ORDINARY },
+   { "iframe", 6, 0, "<iframe>", 8, "</iframe>", 9, tag_ORDINARY },
+   { "ins", 3, 0, "<ins>", 5, "</ins>", 6, tag_ORDINARY },
+   { "kbd", 3, 0, "<kbd>", 5, "</kbd>", 6, tag_ORDINARY },
+   { "label", 5, 0, "<label>", 7, "</label>", 8, tag_ORDINARY },
+   { "legend", 6, 0, "<legend>", 8, "</legend>", 9, tag_ORDINARY },
+   { "li", 2, 0, "<li>", 4, "</li>", 5, tag_ORDINARY },
+   { "main", 4, 0, "<main>", 6, "</main>", 7, tag_ORDINARY },
+   { "map", 3, 0, "<map>", 5, "</map>", 6, tag_ORDINARY },
+   { "mark", 4, 0, "<mark>", 6, "</mark>", 7, tag_ORDINARY },
+   { "menu", 4, 0, "<menu>", 6, "</menu>", 7, tag_ORDINARY },
+   { "meter", 5, 0, "<meter>", 7, "</meter>", 8, tag_ORDINARY },
+   { "nav", 3, 0, "<nav>", 5, "</nav>", 6, tag_ORDINARY },
+   { "noscript", 8, 0, "<noscript>", 10, "</noscript>", 11, tag_ORDINARY },
+   { "object", 6, 0, "<object>", 8, "</object>", 9, tag_ORDINARY },
+   { "ol", 2, 0, "<ol>", 4, "</ol>", 5, tag_ORDINARY },
+   { "optgroup", 8, 0, "<optgroup>", 10, "</optgroup>", 11, tag_ORDINARY },
+   { "option", 6, 0, "<option>", 8, "</option>", 9, tag_ORDINARY },
+   { "output", 6, 0, "<output>", 8, "</output>", 9, tag_ORDINARY },
+   { "p", 1, 0, "<p>", 3, "</p>", 4, tag_ORDINARY },
+   { "picture", 7, 0, "<picture>", 9, "</picture>", 10, tag_ORDINARY },
+   { "pre", 3, 0, "<pre>", 5, "</pre>", 6, tag_ORDINARY },
+   { "progress", 8, 0, "<progress>", 10, "</progress>", 11, tag_ORDINARY },
+   { "q", 1, 0, "<q>", 3, "</q>", 4, tag_ORDINARY },
+   { "rp", 2, 0, "<rp>", 4, "</rp>", 5, tag_ORDINARY },
+   { "rt", 2, 0, "<rt>", 4, "</rt>", 5, tag_ORDINARY },
+   { "ruby", 4, 0, "<ruby>", 6, "</ruby>", 7, tag_ORDINARY },
+   { "s", 1, 0, "<s>", 3, "</s>", 4, tag_ORDINARY },
+   { "samp", 4, 0, "<samp>", 6, "</samp>", 7, tag_ORDINARY },
+   { "search", 6, 0, "<search>", 8, "</search>", 9, tag_ORDINARY },
+   { "section", 7, 0, "<section>", 9, "</section>", 10, tag_ORDINARY },
+   { "select", 6, 0, "<select>", 8, "</select>", 9, tag_ORDINARY },
+   { "slot", 4, 0, "<slot>", 6, "</slot>", 7, tag_ORDINARY },
+   { "small", 5, 0, "<small>", 7, "</small>", 8, tag_ORDINARY },
+   { "span", 4, 0, "<span>", 6, "</span>", 7, tag_ORDINARY },
+   { "strong", 6, 0, "<strong>", 8, "</strong>", 9, tag_ORDINARY },
+   { "sub", 3, 0, "<sub>", 5, "</sub>", 6, tag_ORDINARY },
+   { "summary", 7, 0, "<summary>", 9, "</summary>", 10, tag_ORDINARY },
+   { "sup", 3, 0, "<sup>", 5, "</sup>", 6, tag_ORDINARY },
+   { "table", 5, 0, "<table>", 7, "</table>", 8, tag_ORDINARY },
+   { "tbody", 5, 0, "<tbody>", 7, "</tbody>", 8, tag_ORDINARY },
+   { "td", 2, 0, "<td>", 4, "</td>", 5, tag_ORDINARY },
+   { "template", 8, 0, "<template>", 10, "</template>", 11, tag_ORDINARY },
+   { "textarea", 8, 0, "<textarea>", 10, "</textarea>", 11, tag_ORDINARY },
+   { "tfoot", 5, 0, "<tfoot>", 7, "</tfoot>", 8, tag_ORDINARY },
+   { "th", 2, 0, "<th>", 4, "</th>", 5, tag_ORDINARY },
+   { "thead", 5, 0, "<thead>", 7, "</thead>", 8, tag_ORDINARY },
+   { "time", 4, 0, "<time>", 6, "</time>", 7, tag_ORDINARY },
+   { "title", 5, 0, "<title>", 7, "</title>", 8, tag_ORDINARY },
+   { "tr", 2, 0, "<tr>", 4, "</tr>", 5, tag_ORDINARY },
+   { "u", 1, 0, "<u>", 3, "</u>", 4, tag_ORDINARY },
+   { "ul", 2, 0, "<ul>", 4, "</ul>", 5, tag_ORDINARY },
+   { "var", 3, 0, "<var>", 5, "</var>", 6, tag_ORDINARY },
+   { "video", 5, 0, "<video>", 7, "</video>", 8, tag_ORDINARY },
+};
+
+static const uint8_t tagclass_slots[TAGCLASS_NSLOTS] = {
+   [25] = 100,
+   [30] = 81,
+   [32] = 104,
+   [36] = 70,
+   [42] = 102,
+   [58] = 45,
+   [65] = 87,
+   [71] = 46,
+   [85] = 78,
+   [87] = 33,
+   [92] = 26,
+   [103] = 90,
+   [108] = 116,
+   [110] = 4,
+   [113] = 106,
+   [115] = 54,
+   [116] = 98,
+   [121] = 66,
+   [124] = 58,
+   [125] = 82,
+   [145] = 97,
+   [155] = 3,
+   [172] = 1,
+   [173] = 112,
+   [175] = 99,
+   [180] = 31,
+   [183] = 64,
+   [197] = 67,
+   [199] = 50,
+   [200] = 119,
+   [202] = 24,
+   [208] = 5,
+   [214] = 101,
+   [225] = 22,
+   [233] = 59,
+   [235] = 38,
+   [247] = 73,
+   [252] = 92,
+   [259] = 17,
+   [278] = 60,
+   [279] = 77,
+   [293] = 35,
+   [297] = 68,
+   [307] = 85,
+   [310] = 28,
+   [320] = 69,
+   [324] = 6,
+   [331] = 18,
+   [347] = 111,
+   [363] = 13,
+   [376] = 12,
+   [399] = 10,
+   [420] = 84,
+   [427] = 91,
+   [448] = 83,
+   [463] = 57,
+   [494] = 30,
+   [500] = 25,
+   [512] = 72,
+   [515] = 88,
+   [520] = 76,
+   [528] = 71,
+   [533] = 41,
+   [547] = 15,
+   [549] = 63,
+   [553] = 2,
+   [558] = 96,
+   [571] = 109,
+   [577] = 80,
+   [583] = 42,
+   [586] = 115,
+   [613] = 55,
+   [619] = 113,
+   [621] = 27,
+   [622] = 53,
+   [631] = 75,
+   [636] = 39,
+   [648] = 65,
+   [655] = 11,
+   [660] = 62,
+   [671] = 34,
+   [672] = 89,
+   [673] = 43,
+   [674] = 56,
+   [677] = 74,
+   [681] = 44,
+   [686] = 9,
+   [691] = 117,
+   [697] = 21,
+   [699] = 95,
+   [700] = 7,
+   [707] = 36,
+   [722] = 19,
+   [730] = 94,
+   [751] = 107,
+   [756] = 79,
+   [757] = 105,
+   [759] = 114,
+   [761] = 16,
+   [762] = 51,
+   [775] = 32,
+   [800] = 103,
+   [820] = 8,
+   [831] = 118,
+   [842] = 40,
+   [872] = 52,
+   [873] = 110,
+   [882] = 20,
+   [887] = 49,
+   [895] = 37,
+   [896] = 108,
+   [899] = 61,
+   [920] = 29,
+   [961] = 86,
+   [977] = 23,
+   [990] = 93,
+   [991] = 48,
+   [1015] = 14,
+   [1020] = 47,
+};
@@ -0,0 +1,124 @@
+#!/bin/bash
+# Regression checks for behaviour that is easy to break without
+# noticing. Each check runs l2h in a scratch directory and fails with a
+# message if the result is not what it should be.
+
+die() {
+   echo $@
+   exit 127
+}
+
+usage() {
+   echo "Usage: $0 [options]"
+   echo "  -b L2H       The l2h binary to check (default ./l2h)"
+   echo "  -k           Keep the scratch directory (in \$TMPDIR) instead of removing it"
+   exit 127
+}
+
+L2H=./l2h
+KEEP=
+
+while getopts "b:kh" opt; do
+   case $opt in
+      b) L2H=$OPTARG ;;
+      k) KEEP=1 ;;
+      *) usage ;;
+   esac
+done
+shift $((OPTIND - 1))
+
+[ -x "$L2H" ] || die "Cannot execute $L2H."
+L2H=`realpath "$L2H"`
+
+WORKDIR=`mktemp -d "${TMPDIR:-/tmp}/l2h-regress.XXXXXX"` || die "Cannot create work directory."
+[ -z "$KEEP" ] && trap 'rm -rf "$WORKDIR"' EXIT
+
+FAILED=0
+
+fail() {
+   echo "FAIL: $CHECK: $@"
+   FAILED=$((FAILED + 1))
+}
+
+inode() {
+   stat -c %i "$1"
+}
+
+# Outputs hardlinked by --link-duplicates must come apart again when
+# one of their inputs changes.
+CHECK=link-duplicates-edit
+D="$WORKDIR/$CHECK"
+mkdir -p "$D"
+echo '(html (body (p Same)))' > "$D/a.html.lisp"
+cp "$D/a.html.lisp" "$D/b.html.lisp"
+"$L2H" --link-duplicates "$D" || fail "first conversion failed"
+[ "`inode "$D/a.html"`" = "`inode "$D/b.html"`" ] || fail "outputs were not linked"
+echo '(p EDITED)' >> "$D/b.html.lisp"
+"$L2H" "$D" || fail "second conversion failed"
+[ "`inode "$D/a.html"`" = "`inode "$D/b.html"`" ] && fail "outputs are still linked"
+grep -q EDITED "$D/a.html" && fail "a.html has the edit made to b.html.lisp"
+grep -q EDITED "$D/b.html" || fail "b.html is missing its edit"
+
+# Side outputs of a document split between threads must be those of
+# the document in one piece, with no word breaks between the pieces.
+CHECK=split-side-outputs
+D="$WORKDIR/$CHECK"
+mkdir -p "$D"
+awk 'BEGIN { for (i=0; i<150000; i++) printf "(span w%d)(b x%d)\n", i, i }' > "$D/a.html.lisp"
+for J in 1 4; do
+   "$L2H" -j $J --text --manifest --index "$D/index-$J" "$D" || fail "conversion with -j $J failed"
+   for F in a.html a.html.txt a.html.json; do
+      mv "$D/$F" "$D/$F-$J"
+   done
+done
+for F in a.html a.html.txt a.html.json index; do
+   cmp -s "$D/$F-1" "$D/$F-4" || fail "$F differs between -j 1 and -j 4"
+done
+grep -q "w[0-9]* x" "$D/a.html.txt-4" && fail "words were broken up"
+
+# Pages read from stdin still go to the index.
+CHECK=stdin-index
+D="$WORKDIR/$CHECK"
+mkdir -p "$D"
+echo '(html (head (title Stdin)) (body (p hello)))' | "$L2H" -s --index "$D/index" > /dev/null \
+   || fail "conversion failed"
+grep -q '"title":"Stdin"' "$D/index" || fail "the page is not in the index"
+
+# Tar members must stay below the directory the archive is unpacked in.
+CHECK=tar-out-parent
+D="$WORKDIR/$CHECK"
+mkdir -p "$D/cwd"
+echo '(p x)' > "$D/x.html.lisp"
+(cd "$D/cwd" && "$L2H" --tar-out ../out.tar ../x.html.lisp 2> /dev/null) && fail "../x.html.lisp was accepted"
+tar tf "$D/out.tar" 2> /dev/null | grep -q '\.\.' && fail "a member name has a '..' in it"
+
+# Both read stdin, so only one of them may.
+CHECK=tar-in-stdio
+echo "(p x)" | "$L2H" --tar-in - -s > /dev/null 2>&1 && fail "--tar-in was accepted with -s"
+
+# The delimiter of a (.raw ...) only ends it when the ')' follows.
+CHECK=raw-delimiter-in-body
+OUT=`printf '(p (.raw END abc ENDING more END))\n(p (.raw END a END b END))\n' | "$L2H" -s 2>&1` \
+   || fail "conversion failed"
+[ "$OUT" = "`printf '<p>abc ENDING more </p>\n<p>a END b </p>'`" ] || fail "wrong output: $OUT"
+
+# Input may end in spaces with no newline after them, also when it is
+# large enough for the lexer thread.
+CHECK=trailing-spaces
+D="$WORKDIR/$CHECK"
+mkdir -p "$D"
+printf 'x ' | "$L2H" -s > "$D/small.html" 2>&1 || fail "small input failed"
+[ "`cat "$D/small.html"`" = "x " ] || fail "wrong output for small input"
+awk 'BEGIN { for (i=0; i<20000; i++) print "(p x)"; printf "x   " }' > "$D/big.html.lisp"
+"$L2H" -s < "$D/big.html.lisp" > "$D/big.html" 2>&1 || fail "large input failed"
+"$L2H" -j 2 --pipeline -s < "$D/big.html.lisp" > "$D/big-pipeline.html" 2>&1 \
+   || fail "large input failed with --pipeline"
+cmp -s "$D/big.html" "$D/big-pipeline.html" || fail "--pipeline changed the output"
+
+# The same goes for a list of files read from stdin.
+CHECK=files-from-stdio
+echo "(p x)" | "$L2H" --files-from - -s 2>&1 | grep -q "Errors in invocation" \
+   || fail "--files-from - was accepted with -s"
+
+[ $FAILED -eq 0 ] || die "$FAILED check(s) failed."
+echo "All checks passed."
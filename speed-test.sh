@@ -7,7 +7,7 @@ die() {
 [ -z "$1" ] && die "Need count of first-level directories."
 [ -z "$2" ] && die "Need count of second-level directories."
 
-rm -rf speed-test tmp.txt dcreate.txt dconvert.txt
+rm -rf speed-test tmp.txt dcreate.txt dconvert.txt dserial.txt dpipeline.txt
 
 create_dirs() {
    echo "[$1:$2]"
@@ -19,19 +19,34 @@ create_dirs() {
    echo created dirs
 }
 
-export DURATION_CREATE="$(time -p (create_dirs $1 $2) &> dcreate.txt)"
+export DURATION_CREATE="$({ time -p create_dirs $1 $2; } &> dcreate.txt)"
 export INDIVIDUAL_FSIZE=`du -msh speed-test.html.lisp`
 export TOTAL_FSIZE=$(cat `find speed-test -type f` > tmp.txt && du -msh tmp.txt)
 export DIRCOUNT=`find speed-test -type d | wc -l`
 
 export DURATION_CONVERT=`time -p (./l2h -r speed-test) &> dconvert.txt`
 
+# Identical files are only converted once, so the lexer thread is timed
+# on the one file, converted once for each copy, without and with it.
+convert_each() {
+   for ((N=0;N<$1;N++)); do
+      ./l2h $2 -s < speed-test.html.lisp > /dev/null
+   done
+}
+
+export DURATION_SERIAL="$({ time -p convert_each $(($1 * $2)); } &> dserial.txt)"
+export DURATION_PIPELINE="$({ time -p convert_each $(($1 * $2)) --pipeline; } &> dpipeline.txt)"
+export PIPELINE_OUTPUT=`./l2h --pipeline -s < speed-test.html.lisp | cmp -s - <(./l2h -s < speed-test.html.lisp) && echo same || echo DIFFERENT`
+
 echo FILECOUNT,$(($1 * $2))
 echo INDIVIDUAL_FSIZE,`echo $INDIVIDUAL_FSIZE | cut -f 1 -d \  `
 echo TOTAL_FSIZE,`echo $TOTAL_FSIZE | cut -f 1 -d \  `
 echo DIRCOUNT,$DIRCOUNT
 echo DURATION_CREATE,`grep real dcreate.txt | cut -f 2  -d \ `
 echo DURATION_CONVERT,`grep real dconvert.txt | cut -f 2 -d \  `
+echo DURATION_EACH,`grep real dserial.txt | cut -f 2 -d \  `
+echo DURATION_EACH_PIPELINE,`grep real dpipeline.txt | cut -f 2 -d \  `
+echo PIPELINE_OUTPUT,$PIPELINE_OUTPUT
 
 
 